@@ -118,10 +118,55 @@ typedef struct _PyTier2BBMetadata {
     _Py_CODEUNIT *tier1_end;
     // Tier 2.5 machine code function trampoline pointer
     void *machine_code;
+    // How many bytes of it belong to this BB (the rest of its trace is the
+    // BBs after it).
+    size_t machine_code_size;
+    // Machine code for the BB_BRANCH or BB_JUMP_BACKWARD_LAZY this BB ends
+    // with, if it was compiled. Its exits are patched to point at the
+    // successors' machine code.
+    void *exit_machine_code;
+    // What _PyJIT_PatchExit needs to find the exits in that machine code
+    // (which may have the test before the jump fused in).
+    void *exit_machine_data;
+    // The jump itself.
+    _Py_CODEUNIT *exit_instr;
+    // How many more times the tier 2 interpreter enters this BB before it gets
+    // compiled, or -1 if that has already been tried.
+    int jit_warmup;
+    // The BBs emitted together (by one _PyTier2_Code_DetectAndEmitBB) have
+    // consecutive IDs, and are compiled together. This is the first of them,
+    // and only its jit_region_* fields are used.
+    struct _PyTier2BBMetadata *jit_region;
+    int jit_region_size;
+    // Depth of the stack at the start of the region.
+    int jit_region_stack_depth;
+    // Code units from the start of the region to its end.
+    int jit_region_codeunits;
+    // Where the region starts in the tier 1 code.
+    _Py_CODEUNIT *jit_region_tier1_start;
+    // How many times the region's machine code has bailed out on a failed
+    // guard, since it was last compiled.
+    int jit_region_deopts;
+    // How many times the region has been compiled.
+    int jit_region_compiles;
+    // For regions with a loop header in them: how many more times in a row
+    // the loop's back edge has to be taken without any new BBs showing up
+    // before the loop is compiled as one superblock (or -1, if that's been
+    // tried), how many BBs there were the last time, and how many more times
+    // to keep waiting for that at all. See jit_loop_back_edge.
+    int jit_loop_warmup;
+    int jit_loop_bb_count;
+    int jit_loop_patience;
 } _PyTier2BBMetadata;
 
-// Bump allocator for basic blocks (overallocated)
+// Bump allocator for basic blocks (overallocated). Grows by adding chunks,
+// since frames point into the ones it already has. Each chunk links to the one
+// before it, and only the last one is written to.
 typedef struct _PyTier2BBSpace  {
+    struct _PyTier2BBSpace *prev;
+    // Where this chunk starts, as if all of them were one array: the sum of
+    // the water levels of the ones before it. (in bytes)
+    Py_ssize_t start;
     // (in bytes)
     Py_ssize_t max_capacity;
     // How much space has been consumed in bbs. (in bytes)
@@ -141,7 +186,11 @@ typedef struct _PyTier2BBStartTypeContextTriplet {
 typedef struct _PyTier2Info {
     /* the tier 2 basic block to execute (if any) */
     _PyTier2BBMetadata *_entry_bb;
+    // The last chunk of the BB space.
     _PyTier2BBSpace *_bb_space;
+    // Executable memory for all the machine code of this code object's BBs.
+    // Lazily allocated, and freed along with the code object.
+    struct _PyJITArena *_jit_arena;
     // Keeps track of offset of jump targets (in number of codeunits)
     // from co_code_adaptive.
     int backward_jump_count;
@@ -151,7 +200,11 @@ typedef struct _PyTier2Info {
     // So backward jump offset [1, 2, 3 ,4]
     // will have [[BB_ID1, BB_ID2], [BB_ID3,], [], []]
     // etc.
+    // Each array has max_bb_versions type-specialised slots, then one more for
+    // the generic version that is used once those are full.
     _PyTier2BBStartTypeContextTriplet **backward_jump_target_bb_pairs;
+    // The interpreter's tier2_max_bb_versions when this was allocated.
+    int max_bb_versions;
     // Max len of bb_data
     int bb_data_len;
     // Current index to write into in bb_data. Incremented after each write.
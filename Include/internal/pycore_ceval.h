@@ -77,8 +77,15 @@ extern int _PyPerfTrampoline_Init(int activate);
 extern int _PyPerfTrampoline_Fini(void);
 extern int _PyIsPerfTrampolineActive(void);
 extern PyStatus _PyPerfTrampoline_AfterFork_Child(void);
+// Registers JIT compiled code for co with the active backend, if any. detail
+// says which part of co it is:
+extern void _PyPerfTrampoline_WriteJITCode(const void *code_addr,
+                                           unsigned int code_size,
+                                           PyCodeObject *co,
+                                           const char *detail);
 #ifdef PY_HAVE_PERF_TRAMPOLINE
 extern _PyPerf_Callbacks _Py_perfmap_callbacks;
+extern _PyPerf_Callbacks _Py_perfjit_callbacks;
 #endif
 
 static inline PyObject*
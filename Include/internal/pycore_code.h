@@ -14,9 +14,9 @@ typedef struct {
     uint16_t bb_id_tagged;
     // Forward jump if required since not all successor BBs are fall-through.
     uint16_t successor_jumpby;
-    // Function pointers to trace.
-    uint16_t consequent_trace[4];
-    uint16_t alternative_trace[4];
+    // The _PyTier2BBMetadata of the BB each exit leads to, once generated.
+    uint16_t consequent_bb[4];
+    uint16_t alternative_bb[4];
 } _PyBBBranchCache;
 
 #define INLINE_CACHE_ENTRIES_BB_BRANCH CACHE_ENTRIES(_PyBBBranchCache)
@@ -266,6 +266,13 @@ extern int _PyStaticCode_Init(PyCodeObject *co);
 
 /* Tier 2 interpreter */
 
+// The default number of type-specialised versions of a loop header, after
+// which tier 2 falls back to a single generic one (see
+// PyInterpreterState.tier2_max_bb_versions)
+#ifndef MAX_BB_VERSIONS
+#define MAX_BB_VERSIONS 10
+#endif
+
 // gen_bb_is_successor:
 //   true = successor
 //   false = alternate
@@ -281,19 +288,40 @@ extern int _PyStaticCode_Init(PyCodeObject *co);
 
 PyAPI_FUNC(_Py_CODEUNIT *) _PyCode_Tier2Warmup(struct _PyInterpreterFrame *,
     _Py_CODEUNIT *);
-extern _PyTier2BBMetadata *_PyTier2_GenerateNextBB(
+PyAPI_FUNC(_PyTier2BBMetadata *) _PyTier2_GenerateNextBB(
     struct _PyInterpreterFrame *frame,
     uint16_t bb_id_tagged,
     _Py_CODEUNIT *curr_executing_instr,
     int jumpby,
     _Py_CODEUNIT **tier1_fallback,
     char bb_flag);
-extern _PyTier2BBMetadata *_PyTier2_LocateJumpBackwardsBB(
+PyAPI_FUNC(_PyTier2BBMetadata *) _PyTier2_LocateJumpBackwardsBB(
     struct _PyInterpreterFrame *frame, uint16_t bb_id, int jumpby,
-    _Py_CODEUNIT **tier1_fallback, _Py_CODEUNIT *curr, int stacksize);
-extern void _PyTier2_RewriteForwardJump(_Py_CODEUNIT *bb_branch, _Py_CODEUNIT *target);
-extern void _PyTier2_RewriteBackwardJump(_Py_CODEUNIT *jump_backward_lazy, _Py_CODEUNIT *target, _PyTier2BBMetadata *meta);
+    _Py_CODEUNIT **tier1_fallback, _Py_CODEUNIT *curr, int stacksize,
+    int *keep_lazy);
+PyAPI_FUNC(int) _PyTier2_BBJumpDistance(PyCodeObject *co, _Py_CODEUNIT *from, _Py_CODEUNIT *to);
+PyAPI_FUNC(void) _PyTier2_RewriteForwardJump(PyCodeObject *co, _Py_CODEUNIT *bb_branch, _Py_CODEUNIT *target);
+PyAPI_FUNC(void) _PyTier2_RewriteBackwardJump(PyCodeObject *co, _Py_CODEUNIT *jump_backward_lazy, _PyTier2BBMetadata *meta);
+PyAPI_FUNC(void *) _PyTier2_EnterBB(struct _PyInterpreterFrame *frame, uint16_t bb_id_tagged, int opcode, int successor, _PyTier2BBMetadata *target);
+PyAPI_FUNC(void) _PyTier2_JITDeopt(struct _PyInterpreterFrame *frame, _Py_CODEUNIT *instr);
+PyAPI_FUNC(int) _PyTier2_DumpJIT(PyCodeObject *co, const char *path);
 void _PyTier2TypeContext_Free(_PyTier2TypeContext *type_context);
+void _PyTier2_FreeBBSpace(_PyTier2BBSpace *bb_space);
+
+// Offset of a tier 2 instruction (in code units), as if the chunks of the BB
+// space were one array. Frames entering a BB point one before its start.
+static inline int
+_PyTier2_BBSpaceOffset(_PyTier2BBSpace *space, _Py_CODEUNIT *instr)
+{
+    while (space->prev != NULL &&
+           (instr < space->u_code - 1 ||
+            (char *)space->u_code + space->max_capacity <= (char *)instr))
+    {
+        space = space->prev;
+    }
+    return (int)(space->start / (Py_ssize_t)sizeof(_Py_CODEUNIT) +
+                 (instr - space->u_code));
+}
 #ifdef Py_STATS
 
 
@@ -72,7 +72,8 @@ typedef struct _PyInterpreterFrame {
 static inline int
 _PyInterpreterFrame_LASTI(_PyInterpreterFrame *f) {
     if (f->is_tier2 && f->f_code->_tier2_info != NULL) {
-        return ((int)((f)->prev_instr - f->f_code->_tier2_info->_bb_space->u_code));
+        return _PyTier2_BBSpaceOffset(f->f_code->_tier2_info->_bb_space,
+                                      f->prev_instr);
     }
     return ((int)((f)->prev_instr - _PyCode_CODE((f)->f_code)));
 }
@@ -139,6 +139,10 @@ struct _is {
     // One bit is set for each non-NULL entry in code_watchers
     uint8_t active_code_watchers;
 
+    /* How many type-specialised versions of a loop header tier 2 generates
+       before it uses a generic one (see _PyTier2_LocateJumpBackwardsBB). */
+    int tier2_max_bb_versions;
+
     struct _py_object_state object_state;
     struct _Py_unicode_state unicode;
     struct _Py_float_state float_state;
@@ -4,7 +4,17 @@ typedef enum {
     _JUSTIN_RETURN_GOTO_ERROR = 1,
 } _PyJITReturnCode;
 
-typedef _PyJITReturnCode (*_PyJITFunction)(PyThreadState *tstate, _PyInterpreterFrame *frame, PyObject **stack_pointer, _Py_CODEUNIT *next_instr);
+// Machine code uses its own calling convention, so C code enters it (at the
+// given entry point) through this:
+typedef _PyJITReturnCode (*_PyJITTrampoline)(PyThreadState *tstate, _PyInterpreterFrame *frame, PyObject **stack_pointer, _Py_CODEUNIT *next_instr, void *entry);
 
-PyAPI_FUNC(_PyJITFunction)_PyJIT_CompileTrace(int size, _Py_CODEUNIT **trace, int *jump_target_trace_offsets, int n_jump_targets);
-PyAPI_FUNC(void)_PyJIT_Free(_PyJITFunction trace);
+PyAPI_DATA(_PyJITTrampoline) _PyJIT_Trampoline;
+
+typedef struct _PyJITArena _PyJITArena;
+
+PyAPI_FUNC(_PyJITArena *)_PyJIT_NewArena(void);
+PyAPI_FUNC(void)_PyJIT_FreeArena(_PyJITArena *arena);
+PyAPI_FUNC(int)_PyJIT_CanCompile(int opcode);
+PyAPI_FUNC(void *)_PyJIT_CompileTrace(_PyJITArena *arena, PyCodeObject *co, int size, _Py_CODEUNIT **trace, int *opcodes, int *stack_depths, int *jump_target_trace_offsets, int n_jump_targets, void **jump_target_entries, void **jump_target_exits);
+PyAPI_FUNC(void)_PyJIT_DescribeCode(_PyJITArena *arena, FILE *out, void *code, size_t size, size_t file_offset, _PyTier2BBSpace *bb_space);
+PyAPI_FUNC(void)_PyJIT_PatchExit(void *jump, void *jump_exits, int opcode, int successor, void *target, _Py_CODEUNIT *target_instr);
@@ -14,6 +14,7 @@
 #include "Python.h"
 #include "pycore_atomic_funcs.h" // _Py_atomic_int_get()
 #include "pycore_bitutils.h"     // _Py_bswap32()
+#include "pycore_code.h"          // _PyTier2_DumpJIT()
 #include "pycore_compile.h"      // _PyCompile_CodeGen, _PyCompile_OptimizeCfg
 #include "pycore_fileutils.h"    // _Py_normpath
 #include "pycore_frame.h"        // _PyInterpreterFrame
@@ -685,6 +686,50 @@ clear_extension(PyObject *self, PyObject *args)
 }
 
 
+static PyObject *
+jit_dump(PyObject *self, PyObject *args)
+{
+    PyObject *code, *path;
+    if (!PyArg_ParseTuple(args, "O!O&:jit_dump", &PyCode_Type, &code,
+                          PyUnicode_FSConverter, &path)) {
+        return NULL;
+    }
+    int dumped = _PyTier2_DumpJIT((PyCodeObject *)code, PyBytes_AS_STRING(path));
+    Py_DECREF(path);
+    if (dumped < 0) {
+        return NULL;
+    }
+    return PyLong_FromLong(dumped);
+}
+
+
+static PyObject *
+get_tier2_max_bb_versions(PyObject *self, PyObject *Py_UNUSED(args))
+{
+    PyInterpreterState *interp = _PyInterpreterState_GET();
+    return PyLong_FromLong(interp->tier2_max_bb_versions);
+}
+
+
+static PyObject *
+set_tier2_max_bb_versions(PyObject *self, PyObject *arg)
+{
+    int max_bb_versions = _PyLong_AsInt(arg);
+    if (max_bb_versions == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    // A loop header always has at least the version it was first entered with.
+    if (max_bb_versions < 1) {
+        PyErr_SetString(PyExc_ValueError,
+                        "tier 2 needs at least one version per loop header");
+        return NULL;
+    }
+    PyInterpreterState *interp = _PyInterpreterState_GET();
+    interp->tier2_max_bb_versions = max_bb_versions;
+    Py_RETURN_NONE;
+}
+
+
 static PyMethodDef module_functions[] = {
     {"get_configs", get_configs, METH_NOARGS},
     {"get_recursion_depth", get_recursion_depth, METH_NOARGS},
@@ -707,6 +752,9 @@ static PyMethodDef module_functions[] = {
     _TESTINTERNALCAPI_OPTIMIZE_CFG_METHODDEF
     {"get_interp_settings", get_interp_settings, METH_VARARGS, NULL},
     {"clear_extension", clear_extension, METH_VARARGS, NULL},
+    {"jit_dump", jit_dump, METH_VARARGS, NULL},
+    {"get_tier2_max_bb_versions", get_tier2_max_bb_versions, METH_NOARGS, NULL},
+    {"set_tier2_max_bb_versions", set_tier2_max_bb_versions, METH_O, NULL},
     {NULL, NULL} /* sentinel */
 };
 
@@ -6,6 +6,7 @@
 #include "pycore_code.h"          // _PyCodeConstructor
 #include "pycore_frame.h"         // FRAME_SPECIALS_SIZE
 #include "pycore_interp.h"        // PyInterpreterState.co_extra_freefuncs
+#include "pycore_jit.h"           // _PyJIT_FreeArena()
 #include "pycore_opcode.h"        // _PyOpcode_Deopt
 #include "pycore_pystate.h"       // _PyInterpreterState_GET()
 #include "pycore_tuple.h"         // _PyTuple_ITEMS()
@@ -1713,9 +1714,12 @@ code_tier2_fini(PyCodeObject *co)
     _PyTier2Info *t2_info = co->_tier2_info;
     t2_info->_entry_bb = NULL;
     if (t2_info->_bb_space != NULL) {
-        PyMem_Free(t2_info->_bb_space);
+        _PyTier2_FreeBBSpace(t2_info->_bb_space);
         t2_info->_bb_space = NULL;
     }
+    // Frees all the machine code of the BBs in one go.
+    _PyJIT_FreeArena(t2_info->_jit_arena);
+    t2_info->_jit_arena = NULL;
     
     if (t2_info->backward_jump_count > 0 &&
         t2_info->backward_jump_offsets != NULL) {
@@ -2017,9 +2021,18 @@ code_getcodetier2(PyCodeObject *code, void *closure)
     if (code->_tier2_info == NULL) {
         return PyBytes_FromStringAndSize("", 0);
     }
-    return PyBytes_FromStringAndSize(
-        (const char *)code->_tier2_info->_bb_space->u_code,
-        code->_tier2_info->_bb_space->water_level);
+    // All the chunks of the BB space, back to back:
+    _PyTier2BBSpace *space = code->_tier2_info->_bb_space;
+    PyObject *bytes = PyBytes_FromStringAndSize(NULL,
+        space->start + space->water_level);
+    if (bytes == NULL) {
+        return NULL;
+    }
+    for (; space != NULL; space = space->prev) {
+        memcpy(PyBytes_AS_STRING(bytes) + space->start, space->u_code,
+               space->water_level);
+    }
+    return bytes;
 }
 
 static PyGetSetDef code_getsetlist[] = {
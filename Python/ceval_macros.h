@@ -116,6 +116,61 @@
         goto start_frame;                               \
     } while (0)
 
+/* Run a tier 2 BB's machine code, picking up wherever it leaves off. The
+ * following code is partially adapted from Brandt Bucher's
+ * https://github.com/brandtbucher/cpython/blob/justin/Python/bytecodes.c#L2175
+ */
+#define GO_TO_TRACE(TRACE)                                          \
+    do {                                                            \
+        _PyJITReturnCode status = _PyJIT_Trampoline(                \
+            tstate, frame, stack_pointer, next_instr, (TRACE));     \
+        frame = cframe.current_frame;                               \
+        next_instr = frame->prev_instr;                             \
+        stack_pointer = _PyFrame_GetStackPointer(frame);            \
+        switch (status) {                                           \
+        case _JUSTIN_RETURN_DEOPT:                                  \
+            /* Pick up right where it left off, in tier 2: */       \
+            _PyTier2_JITDeopt(frame, next_instr);                   \
+            NEXTOPARG();                                            \
+            DISPATCH_GOTO();                                        \
+        case _JUSTIN_RETURN_OK:                                     \
+            DISPATCH();                                             \
+        case _JUSTIN_RETURN_GOTO_ERROR:                             \
+            goto error;                                             \
+        }                                                           \
+        Py_UNREACHABLE();                                           \
+    } while (0)
+
+/* Run the tier 2 BB that one exit of a jump leads to: its machine code if it
+ * has some (or just got hot enough to get some), or else the tier 2 code that
+ * next_instr already points at. See _PyTier2_EnterBB.
+ */
+#define GO_TO_BB(BB_ID_TAGGED, OPCODE, SUCCESSOR, META)                 \
+    do {                                                                \
+        _PyTier2BBMetadata *_bb = (_PyTier2BBMetadata *)(META);         \
+        if (_bb != NULL) {                                              \
+            void *_trace = _PyTier2_EnterBB(                            \
+                frame, (BB_ID_TAGGED), (OPCODE), (SUCCESSOR), _bb);     \
+            if (_trace != NULL) {                                       \
+                GO_TO_TRACE(_trace);                                    \
+            }                                                           \
+        }                                                               \
+        DISPATCH();                                                     \
+    } while (0)
+
+/* Tier 2 jumps are relative, unless the BB they go to is out of reach (see
+ * _PyTier2_BBJumpDistance). Those jump by 0, and go to META instead. */
+#define JUMPBY_BB(N, META)                                              \
+    do {                                                                \
+        int _jumpby = (N);                                              \
+        if (_jumpby != 0) {                                             \
+            JUMPBY(_jumpby);                                            \
+        }                                                               \
+        else {                                                          \
+            next_instr = ((_PyTier2BBMetadata *)(META))->tier2_start;   \
+        }                                                               \
+    } while (0)
+
 #define CHECK_EVAL_BREAKER() \
     _Py_CHECK_EMSCRIPTEN_SIGNALS_PERIODICALLY(); \
     if (_Py_atomic_load_relaxed_int32(&tstate->interp->ceval.eval_breaker)) { \
@@ -141,8 +196,10 @@ GETITEM(PyObject *v, Py_ssize_t i) {
 
 /* The integer overflow is checked by an assertion below. */
 // TODO change this calculation when interpreter is bb aware.
-#define INSTR_OFFSET() ((int)(next_instr - \
-    (frame->is_tier2 && frame->f_code->_tier2_info != NULL ? frame->f_code->_tier2_info->_bb_space->u_code : _PyCode_CODE(frame->f_code))))
+#define INSTR_OFFSET() \
+    (frame->is_tier2 && frame->f_code->_tier2_info != NULL ? \
+     _PyTier2_BBSpaceOffset(frame->f_code->_tier2_info->_bb_space, next_instr) : \
+     (int)(next_instr - _PyCode_CODE(frame->f_code)))
 #define NEXTOPARG()  do { \
         _Py_CODEUNIT word = *next_instr; \
         opcode = word.op.code; \
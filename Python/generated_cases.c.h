@@ -506,7 +506,7 @@
 
             if (is_successor) {
                 unboxed_float = *((PyObject **)(&(((PyFloatObject *)maybe_float)->ob_fval)));
-                Py_DECREF(maybe_float);
+                _Py_DECREF_SPECIALIZED(maybe_float, _PyFloat_ExactDealloc);
             }
             else {
                 unboxed_float = maybe_float;
@@ -2604,25 +2604,10 @@
             JUMPBY(-oparg);
             JUMPBY(INLINE_CACHE_ENTRIES_JUMP_BACKWARD);
             CHECK_EVAL_BREAKER();
-            _PyJITFunction trace = (_PyJITFunction)read_obj(cache->consequent_trace);
-            if (trace != NULL) {
-                // The following code is partially adapted from Brandt Bucher's https://github.com/brandtbucher/cpython/blob/justin/Python/bytecodes.c#L2175
-                _PyJITReturnCode status = ((_PyJITFunction)(trace))(tstate, frame, stack_pointer, next_instr);
-                frame = cframe.current_frame;
-                next_instr = frame->prev_instr;
-                stack_pointer = _PyFrame_GetStackPointer(frame);
-                switch (status) {
-                case _JUSTIN_RETURN_DEOPT:
-                    NEXTOPARG();
-                    opcode = _PyOpcode_Deopt[opcode];
-                    DISPATCH_GOTO();
-                case _JUSTIN_RETURN_OK:
-                    DISPATCH();
-                case _JUSTIN_RETURN_GOTO_ERROR:
-                    goto error;
-                }
-                Py_UNREACHABLE();
-            }
+            // Tier 1 has no BB to go to, and leaves the cache zeroed:
+            GO_TO_BB(cache->bb_id_tagged, BB_JUMP_BACKWARD_LAZY, 1,
+                     read_obj(cache->consequent_bb));
+            next_instr += 10;
             DISPATCH();
         }
 
@@ -4296,10 +4281,9 @@
             _PyBBBranchCache *cache = (_PyBBBranchCache *)next_instr;
             _PyTier2BBMetadata *meta = NULL;
             _Py_CODEUNIT *tier1_fallback = NULL;
-            if (BB_TEST_IS_SUCCESSOR(frame)) {
+            int successor = BB_TEST_IS_SUCCESSOR(frame);
+            if (successor) {
                 // Generate consequent.
-                // Rewrite self
-                _py_set_opcode(next_instr - 1, BB_BRANCH_IF_FLAG_UNSET);
                 meta = _PyTier2_GenerateNextBB(
                     frame, cache->bb_id_tagged, next_instr - 1,
                     0, &tier1_fallback, frame->bb_test);
@@ -4308,12 +4292,12 @@
                     next_instr = tier1_fallback;
                     DISPATCH();
                 }
-                memcpy(cache->consequent_trace, &meta->machine_code, sizeof(uint64_t));
+                // Rewrite self
+                _py_set_opcode(next_instr - 1, BB_BRANCH_IF_FLAG_UNSET);
+                write_obj(cache->consequent_bb, (PyObject *)meta);
             }
             else {
                 // Generate alternative.
-                // Rewrite self
-                _py_set_opcode(next_instr - 1, BB_BRANCH_IF_FLAG_SET);
                 meta = _PyTier2_GenerateNextBB(
                     frame, cache->bb_id_tagged, next_instr - 1,
                     oparg, &tier1_fallback, frame->bb_test);
@@ -4322,265 +4306,135 @@
                     next_instr = tier1_fallback;
                     DISPATCH();
                 }
-                memcpy(cache->alternative_trace, &meta->machine_code, sizeof(uint64_t));
+                // Rewrite self
+                _py_set_opcode(next_instr - 1, BB_BRANCH_IF_FLAG_SET);
+                write_obj(cache->alternative_bb, (PyObject *)meta);
             }
-            Py_ssize_t forward_jump = meta->tier2_start - next_instr;
-            assert((uint16_t)forward_jump == forward_jump);
-            cache->successor_jumpby = (uint16_t)forward_jump;
+            // 0 if it's out of reach (see JUMPBY_BB):
+            cache->successor_jumpby = (uint16_t)_PyTier2_BBJumpDistance(
+                frame->f_code, next_instr, meta->tier2_start);
             next_instr = meta->tier2_start;
-            // Could not generate machine code, fall back to tier 2 instructions.
-            if (meta->machine_code == NULL) {
-                DISPATCH();
-            }
-            // The following code is partially adapted from Brandt Bucher's https://github.com/brandtbucher/cpython/blob/justin/Python/bytecodes.c#L2175
-            _PyJITReturnCode status = ((_PyJITFunction)(meta->machine_code))(tstate, frame, stack_pointer, next_instr);
-            frame = cframe.current_frame;
-            next_instr = frame->prev_instr;
-            stack_pointer = _PyFrame_GetStackPointer(frame);
-            switch (status) {
-            case _JUSTIN_RETURN_DEOPT:
-                NEXTOPARG();
-                opcode = _PyOpcode_Deopt[opcode];
-                DISPATCH_GOTO();
-            case _JUSTIN_RETURN_OK:
-                DISPATCH();
-            case _JUSTIN_RETURN_GOTO_ERROR:
-                goto error;
-            }
-            Py_UNREACHABLE();
+            GO_TO_BB(cache->bb_id_tagged, BB_BRANCH, successor, meta);
         }
 
         TARGET(BB_BRANCH_IF_FLAG_UNSET) {
+            _PyBBBranchCache *cache = (_PyBBBranchCache *)next_instr;
             if (!BB_TEST_IS_SUCCESSOR(frame)) {
-                _Py_CODEUNIT *curr = next_instr - 1;
-                _PyTier2BBMetadata *meta = NULL;
-                _PyBBBranchCache *cache = (_PyBBBranchCache *)next_instr;
-                _Py_CODEUNIT *tier1_fallback = NULL;
-
-                meta = _PyTier2_GenerateNextBB(
-                    frame, cache->bb_id_tagged, next_instr - 1,
-                    oparg, &tier1_fallback, frame->bb_test);
+                // Only there already if it was out of reach of a jump (see
+                // _PyTier2_RewriteForwardJump):
+                _PyTier2BBMetadata *meta =
+                    (_PyTier2BBMetadata *)read_obj(cache->alternative_bb);
                 if (meta == NULL) {
-                    // Fall back to tier 1.
-                    next_instr = tier1_fallback;
-                }
-                else {
-                    next_instr = meta->tier2_start;
-                }
-                // Rewrite self
-                _PyTier2_RewriteForwardJump(curr, next_instr);
-                memcpy(cache->alternative_trace, &meta->machine_code, sizeof(uint64_t));
-                if (meta->machine_code != NULL) {
-                    // The following code is partially adapted from Brandt Bucher's https://github.com/brandtbucher/cpython/blob/justin/Python/bytecodes.c#L2175
-                    _PyJITReturnCode status = ((_PyJITFunction)(meta->machine_code))(tstate, frame, stack_pointer, next_instr);
-                    frame = cframe.current_frame;
-                    next_instr = frame->prev_instr;
-                    stack_pointer = _PyFrame_GetStackPointer(frame);
-                    switch (status) {
-                    case _JUSTIN_RETURN_DEOPT:
-                        NEXTOPARG();
-                        opcode = _PyOpcode_Deopt[opcode];
-                        DISPATCH_GOTO();
-                    case _JUSTIN_RETURN_OK:
+                    _Py_CODEUNIT *tier1_fallback = NULL;
+                    meta = _PyTier2_GenerateNextBB(
+                        frame, cache->bb_id_tagged, next_instr - 1,
+                        oparg, &tier1_fallback, frame->bb_test);
+                    if (meta == NULL) {
+                        // Fall back to tier 1.
+                        next_instr = tier1_fallback;
                         DISPATCH();
-                    case _JUSTIN_RETURN_GOTO_ERROR:
-                        goto error;
                     }
-                    Py_UNREACHABLE();
+                    write_obj(cache->alternative_bb, (PyObject *)meta);
+                    // Rewrite self
+                    _PyTier2_RewriteForwardJump(frame->f_code, next_instr - 1,
+                        meta->tier2_start);
                 }
-                DISPATCH();
-            }
-            _PyBBBranchCache *cache = (_PyBBBranchCache *)next_instr;
-            JUMPBY(cache->successor_jumpby);
-            _PyJITFunction trace = (_PyJITFunction)read_obj(cache->consequent_trace);
-            if (trace != NULL) {
-                // The following code is partially adapted from Brandt Bucher's https://github.com/brandtbucher/cpython/blob/justin/Python/bytecodes.c#L2175
-                _PyJITReturnCode status = ((_PyJITFunction)(trace))(tstate, frame, stack_pointer, next_instr);
-                frame = cframe.current_frame;
-                next_instr = frame->prev_instr;
-                stack_pointer = _PyFrame_GetStackPointer(frame);
-                switch (status) {
-                case _JUSTIN_RETURN_DEOPT:
-                    NEXTOPARG();
-                    opcode = _PyOpcode_Deopt[opcode];
-                    DISPATCH_GOTO();
-                case _JUSTIN_RETURN_OK:
-                    DISPATCH();
-                case _JUSTIN_RETURN_GOTO_ERROR:
-                    goto error;
-                }
-                Py_UNREACHABLE();
+                next_instr = meta->tier2_start;
+                GO_TO_BB(cache->bb_id_tagged, BB_BRANCH, 0, meta);
             }
-
-            DISPATCH();
+            PyObject *meta = read_obj(cache->consequent_bb);
+            JUMPBY_BB(cache->successor_jumpby, meta);
+            GO_TO_BB(cache->bb_id_tagged, BB_BRANCH, 1, meta);
         }
 
         TARGET(BB_JUMP_IF_FLAG_UNSET) {
             _PyBBBranchCache *cache = (_PyBBBranchCache *)next_instr;
-            _PyJITFunction trace = NULL;
             if (!BB_TEST_IS_SUCCESSOR(frame)) {
                 JUMPBY(oparg);
-                trace = (_PyJITFunction)read_obj(cache->alternative_trace);
-            }
-            else {
-                JUMPBY(cache->successor_jumpby);
-                trace = (_PyJITFunction)read_obj(cache->consequent_trace);
-            }
-
-            if (trace != NULL) {
-                // The following code is partially adapted from Brandt Bucher's https://github.com/brandtbucher/cpython/blob/justin/Python/bytecodes.c#L2175
-                _PyJITReturnCode status = ((_PyJITFunction)(trace))(tstate, frame, stack_pointer, next_instr);
-                frame = cframe.current_frame;
-                next_instr = frame->prev_instr;
-                stack_pointer = _PyFrame_GetStackPointer(frame);
-                switch (status) {
-                case _JUSTIN_RETURN_DEOPT:
-                    NEXTOPARG();
-                    opcode = _PyOpcode_Deopt[opcode];
-                    DISPATCH_GOTO();
-                case _JUSTIN_RETURN_OK:
-                    DISPATCH();
-                case _JUSTIN_RETURN_GOTO_ERROR:
-                    goto error;
-                }
-                Py_UNREACHABLE();
+                GO_TO_BB(cache->bb_id_tagged, BB_BRANCH, 0,
+                         read_obj(cache->alternative_bb));
             }
-            DISPATCH();
+            PyObject *meta = read_obj(cache->consequent_bb);
+            JUMPBY_BB(cache->successor_jumpby, meta);
+            GO_TO_BB(cache->bb_id_tagged, BB_BRANCH, 1, meta);
         }
 
         TARGET(BB_BRANCH_IF_FLAG_SET) {
+            _PyBBBranchCache *cache = (_PyBBBranchCache *)next_instr;
             if (BB_TEST_IS_SUCCESSOR(frame)) {
-                _Py_CODEUNIT *curr = next_instr - 1;
-                _PyTier2BBMetadata *meta = NULL;
-                _Py_CODEUNIT *t2_nextinstr = NULL;
-                _PyBBBranchCache *cache = (_PyBBBranchCache *)next_instr;
-                _Py_CODEUNIT *tier1_fallback = NULL;
-                meta = _PyTier2_GenerateNextBB(
-                    frame, cache->bb_id_tagged, next_instr - 1,
-                //  v   We generate from the tier1 consequent BB, so offset (oparg) is 0.
-                    0, &tier1_fallback, frame->bb_test);
+                // Only there already if it was out of reach of a jump (see
+                // _PyTier2_RewriteForwardJump):
+                _PyTier2BBMetadata *meta =
+                    (_PyTier2BBMetadata *)read_obj(cache->consequent_bb);
                 if (meta == NULL) {
-                    // Fall back to tier 1.
-                    next_instr = tier1_fallback;
-                }
-                else {
-                    next_instr = meta->tier2_start;
-                }
-
-                // Rewrite self
-                _PyTier2_RewriteForwardJump(curr, next_instr);
-                memcpy(cache->consequent_trace, &meta->machine_code, sizeof(uint64_t));
-                if (meta->machine_code != NULL) {
-                    // The following code is partially adapted from Brandt Bucher's https://github.com/brandtbucher/cpython/blob/justin/Python/bytecodes.c#L2175
-                    _PyJITReturnCode status = ((_PyJITFunction)(meta->machine_code))(tstate, frame, stack_pointer, next_instr);
-                    frame = cframe.current_frame;
-                    next_instr = frame->prev_instr;
-                    stack_pointer = _PyFrame_GetStackPointer(frame);
-                    switch (status) {
-                    case _JUSTIN_RETURN_DEOPT:
-                        NEXTOPARG();
-                        opcode = _PyOpcode_Deopt[opcode];
-                        DISPATCH_GOTO();
-                    case _JUSTIN_RETURN_OK:
+                    _Py_CODEUNIT *tier1_fallback = NULL;
+                    meta = _PyTier2_GenerateNextBB(
+                        frame, cache->bb_id_tagged, next_instr - 1,
+                    //  v   We generate from the tier1 consequent BB, so offset (oparg) is 0.
+                        0, &tier1_fallback, frame->bb_test);
+                    if (meta == NULL) {
+                        // Fall back to tier 1.
+                        next_instr = tier1_fallback;
                         DISPATCH();
-                    case _JUSTIN_RETURN_GOTO_ERROR:
-                        goto error;
                     }
-                    Py_UNREACHABLE();
-                }
-                DISPATCH();
-            }
-            _PyBBBranchCache *cache = (_PyBBBranchCache *)next_instr;
-            JUMPBY(cache->successor_jumpby);
-            _PyJITFunction trace = (_PyJITFunction)read_obj(cache->alternative_trace);
-            if (trace != NULL) {
-                // The following code is partially adapted from Brandt Bucher's https://github.com/brandtbucher/cpython/blob/justin/Python/bytecodes.c#L2175
-                _PyJITReturnCode status = ((_PyJITFunction)(trace))(tstate, frame, stack_pointer, next_instr);
-                frame = cframe.current_frame;
-                next_instr = frame->prev_instr;
-                stack_pointer = _PyFrame_GetStackPointer(frame);
-                switch (status) {
-                case _JUSTIN_RETURN_DEOPT:
-                    NEXTOPARG();
-                    opcode = _PyOpcode_Deopt[opcode];
-                    DISPATCH_GOTO();
-                case _JUSTIN_RETURN_OK:
-                    DISPATCH();
-                case _JUSTIN_RETURN_GOTO_ERROR:
-                    goto error;
+                    write_obj(cache->consequent_bb, (PyObject *)meta);
+                    // Rewrite self
+                    _PyTier2_RewriteForwardJump(frame->f_code, next_instr - 1,
+                        meta->tier2_start);
                 }
-                Py_UNREACHABLE();
+                next_instr = meta->tier2_start;
+                GO_TO_BB(cache->bb_id_tagged, BB_BRANCH, 1, meta);
             }
-            DISPATCH();
+            PyObject *meta = read_obj(cache->alternative_bb);
+            JUMPBY_BB(cache->successor_jumpby, meta);
+            GO_TO_BB(cache->bb_id_tagged, BB_BRANCH, 0, meta);
         }
 
         TARGET(BB_JUMP_IF_FLAG_SET) {
             _PyBBBranchCache *cache = (_PyBBBranchCache *)next_instr;
-            _PyJITFunction trace = NULL;
             if (BB_TEST_IS_SUCCESSOR(frame)) {
                 JUMPBY(oparg);
-                trace = (_PyJITFunction)read_obj(cache->consequent_trace);
+                GO_TO_BB(cache->bb_id_tagged, BB_BRANCH, 1,
+                         read_obj(cache->consequent_bb));
             }
-            else {
-                JUMPBY(cache->successor_jumpby);
-                trace = (_PyJITFunction)read_obj(cache->alternative_trace);
-            }
-            if (trace != NULL) {
-                // The following code is partially adapted from Brandt Bucher's https://github.com/brandtbucher/cpython/blob/justin/Python/bytecodes.c#L2175
-                _PyJITReturnCode status = ((_PyJITFunction)(trace))(tstate, frame, stack_pointer, next_instr);
-                frame = cframe.current_frame;
-                next_instr = frame->prev_instr;
-                stack_pointer = _PyFrame_GetStackPointer(frame);
-                switch (status) {
-                case _JUSTIN_RETURN_DEOPT:
-                    NEXTOPARG();
-                    opcode = _PyOpcode_Deopt[opcode];
-                    DISPATCH_GOTO();
-                case _JUSTIN_RETURN_OK:
-                    DISPATCH();
-                case _JUSTIN_RETURN_GOTO_ERROR:
-                    goto error;
-                }
-                Py_UNREACHABLE();
-            }
-            DISPATCH();
+            PyObject *meta = read_obj(cache->alternative_bb);
+            JUMPBY_BB(cache->successor_jumpby, meta);
+            GO_TO_BB(cache->bb_id_tagged, BB_BRANCH, 0, meta);
         }
 
         TARGET(BB_JUMP_BACKWARD_LAZY) {
-            _Py_CODEUNIT *curr = next_instr - 1;
-            _Py_CODEUNIT *t2_nextinstr = NULL;
             _PyBBBranchCache *cache = (_PyBBBranchCache *)next_instr;
-            _Py_CODEUNIT *tier1_fallback = NULL;
-            _PyTier2BBMetadata *meta = _PyTier2_LocateJumpBackwardsBB(
-                frame, cache->bb_id_tagged, -oparg, &tier1_fallback, curr,
-                STACK_LEVEL());
+            // Only there already if it was out of reach of a jump (see
+            // _PyTier2_RewriteBackwardJump):
+            _PyTier2BBMetadata *meta =
+                (_PyTier2BBMetadata *)read_obj(cache->consequent_bb);
             if (meta == NULL) {
-                // Fall back to tier 1.
-                next_instr = tier1_fallback;
+                _Py_CODEUNIT *tier1_fallback = NULL;
+                int keep_lazy = 0;
+                meta = _PyTier2_LocateJumpBackwardsBB(
+                    frame, cache->bb_id_tagged, -oparg, &tier1_fallback,
+                    next_instr - 1, STACK_LEVEL(), &keep_lazy);
+                if (meta == NULL) {
+                    // Fall back to tier 1.
+                    next_instr = tier1_fallback;
+                    DISPATCH();
+                }
+                if (keep_lazy) {
+                    // Going to the loop's generic version, which meant boxing
+                    // some values. That happens again every time, so this
+                    // isn't rewritten (or linked to the BB's machine code):
+                    next_instr = meta->tier2_start;
+                    CHECK_EVAL_BREAKER();
+                    DISPATCH();
+                }
+                // Rewrite self
+                _PyTier2_RewriteBackwardJump(frame->f_code, next_instr - 1, meta);
+                next_instr = meta->tier2_start;
             }
             else {
+                // Stuck being a loop's back edge for good:
                 next_instr = meta->tier2_start;
+                CHECK_EVAL_BREAKER();
             }
-
-            // Rewrite self
-            _PyTier2_RewriteBackwardJump(curr, next_instr, meta);
-            if (meta != NULL && meta->machine_code != NULL) {
-                // The following code is partially adapted from Brandt Bucher's https://github.com/brandtbucher/cpython/blob/justin/Python/bytecodes.c#L2175
-                _PyJITReturnCode status = ((_PyJITFunction)(meta->machine_code))(tstate, frame, stack_pointer, next_instr);
-                frame = cframe.current_frame;
-                next_instr = frame->prev_instr;
-                stack_pointer = _PyFrame_GetStackPointer(frame);
-                switch (status) {
-                case _JUSTIN_RETURN_DEOPT:
-                    NEXTOPARG();
-                    opcode = _PyOpcode_Deopt[opcode];
-                    DISPATCH_GOTO();
-                case _JUSTIN_RETURN_OK:
-                    DISPATCH();
-                case _JUSTIN_RETURN_GOTO_ERROR:
-                    goto error;
-                }
-                Py_UNREACHABLE();
-            }
-            DISPATCH();
+            GO_TO_BB(cache->bb_id_tagged, BB_JUMP_BACKWARD_LAZY, 1, meta);
         }
@@ -1,14 +1,25 @@
 #include "Python.h"
+// Everything Tools/justin/template.c includes, so the linker can resolve all
+// of the symbols the stencils use (see symbol_addresses in jit_stencils.h):
+#include "pycore_frame.h"
 #include "pycore_abstract.h"
+#include "pycore_call.h"
 #include "pycore_ceval.h"
+#include "pycore_dict.h"
+#include "pycore_emscripten_signal.h"
+#include "pycore_intrinsics.h"
 #include "pycore_jit.h"
+#include "pycore_long.h"
+#include "pycore_object.h"
 #include "pycore_opcode.h"
+#include "pycore_pyerrors.h"
+#include "pycore_range.h"
+#include "pycore_sliceobject.h"
+#include "pycore_code.h"
 
 #include "ceval_macros.h"
 #include "jit_stencils.h"
 
-// XXX: Pre-populate symbol addresses once.
-
 #ifdef MS_WINDOWS
     #include <psapi.h>
     #include <windows.h>
@@ -48,73 +59,426 @@
 
 static int stencils_loaded = 0;
 
+// Almost every symbol is filled in by the linker. The few that Python's
+// headers don't declare (like the C library's assertion handler) are looked
+// up here, once:
 static int
-preload_stencil(const Stencil *loading)
-{
-    for (size_t i = 0; i < loading->nloads; i++) {
-        const SymbolLoad *load = &loading->loads[i];
-        uintptr_t *addr = (uintptr_t *)(loading->bytes + load->offset);
-        uintptr_t value = (uintptr_t)DLSYM(load->symbol);
-        if (value == 0) {
-            printf("XXX: Failed to preload symbol %s!\n", load->symbol);
-            return -1;
+resolve_symbols(void)
+{
+    for (size_t i = 0; i < Py_ARRAY_LENGTH(symbol_addresses); i++) {
+        if (symbol_addresses[i] == 0) {
+            symbol_addresses[i] = (uintptr_t)DLSYM(symbol_names[i]);
+            if (symbol_addresses[i] == 0) {
+                printf("XXX: Failed to resolve symbol %s!\n", symbol_names[i]);
+                return -1;
+            }
         }
-        *addr = value + load->addend + load->pc * (uintptr_t)addr;
     }
     return 0;
 }
 
-static unsigned char *
-alloc(size_t nbytes)
+// Executable memory is handed out from per-code-object arenas. Each arena is a
+// linked list of mmapped chunks with a bump pointer into the newest one.
+// Nothing is ever freed individually; the whole arena goes away with its code
+// object (see _PyJIT_FreeArena).
+
+#define ARENA_CHUNK_SIZE (1 << 14)
+#define ARENA_ALIGNMENT 16
+
+typedef struct _PyJITArenaChunk {
+    struct _PyJITArenaChunk *prev;
+    // Total mapped size of this chunk (including this header).
+    size_t size;
+} _PyJITArenaChunk;
+
+// Where each stencil of a trace ended up, for _PyJIT_DescribeCode:
+typedef struct {
+    unsigned char *code;
+    const Stencil *stencil;
+    _Py_CODEUNIT *instruction;
+} Placement;
+
+typedef struct TraceMap {
+    struct TraceMap *prev;
+    int nplacements;
+    Placement placements[];
+} TraceMap;
+
+struct _PyJITArena {
+    _PyJITArenaChunk *chunks;
+    unsigned char *head;
+    unsigned char *limit;
+    TraceMap *maps;
+};
+
+#define ARENA_HEADER_SIZE \
+    _Py_SIZE_ROUND_UP(sizeof(_PyJITArenaChunk), ARENA_ALIGNMENT)
+
+// Stencils call into the rest of Python (and jump to each other) with 32-bit
+// PC-relative displacements where they can, which only reach 2 GiB. So ask for
+// executable memory a little below Python itself, working downwards from
+// there. The kernel is free to ignore us, in which case traces that can't
+// reach everything they need just aren't compiled (see patch):
+#define MMAP_DISTANCE ((uintptr_t)1 << 29)
+
+static uintptr_t mmap_hint = 0;
+
+static void *
+mmap_near_python(size_t size)
 {
-    nbytes += sizeof(size_t);
-    unsigned char *memory = MMAP(nbytes);
-    if (memory == MAP_FAILED) {
-        return NULL;
+#ifdef MS_WINDOWS
+    return MMAP(size);
+#else
+    if (mmap_hint == 0) {
+        uintptr_t python = (uintptr_t)&_PyJIT_CompileTrace;
+        python &= ~(uintptr_t)(ARENA_CHUNK_SIZE - 1);
+        mmap_hint = (python > 2 * MMAP_DISTANCE) ? python - MMAP_DISTANCE
+                                                 : python + 2 * MMAP_DISTANCE;
     }
-    assert(memory);
-    *(size_t *)memory = nbytes;
-    return memory + sizeof(size_t);
+    mmap_hint -= size;
+    return mmap((void *)mmap_hint, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#endif
 }
 
+_PyJITArena *
+_PyJIT_NewArena(void)
+{
+    _PyJITArena *arena = PyMem_Malloc(sizeof(_PyJITArena));
+    if (arena == NULL) {
+        return NULL;
+    }
+    arena->chunks = NULL;
+    arena->head = NULL;
+    arena->limit = NULL;
+    arena->maps = NULL;
+    return arena;
+}
 
 void
-_PyJIT_Free(_PyJITFunction trace)
+_PyJIT_FreeArena(_PyJITArena *arena)
+{
+    if (arena == NULL) {
+        return;
+    }
+    _PyJITArenaChunk *chunk = arena->chunks;
+    while (chunk != NULL) {
+        _PyJITArenaChunk *prev = chunk->prev;
+        MUNMAP(chunk, chunk->size);
+        chunk = prev;
+    }
+    TraceMap *map = arena->maps;
+    while (map != NULL) {
+        TraceMap *prev = map->prev;
+        PyMem_Free(map);
+        map = prev;
+    }
+    PyMem_Free(arena);
+}
+
+static unsigned char *
+alloc(_PyJITArena *arena, size_t nbytes)
 {
-    unsigned char *memory = (unsigned char *)trace - sizeof(size_t);
-    size_t nbytes = *(size_t *)memory;
-    MUNMAP(memory, nbytes);
+    nbytes = _Py_SIZE_ROUND_UP(nbytes, ARENA_ALIGNMENT);
+    if (arena->head == NULL || (size_t)(arena->limit - arena->head) < nbytes) {
+        // Doesn't fit, so map a new chunk. Whatever is left at the end of the
+        // current one is simply wasted.
+        size_t size = _Py_SIZE_ROUND_UP(ARENA_HEADER_SIZE + nbytes,
+                                        ARENA_CHUNK_SIZE);
+        _PyJITArenaChunk *chunk = mmap_near_python(size);
+        if (chunk == MAP_FAILED) {
+            return NULL;
+        }
+        assert(chunk);
+        chunk->prev = arena->chunks;
+        chunk->size = size;
+        arena->chunks = chunk;
+        arena->head = (unsigned char *)chunk + ARENA_HEADER_SIZE;
+        arena->limit = (unsigned char *)chunk + size;
+    }
+    unsigned char *memory = arena->head;
+    arena->head += nbytes;
+    assert(arena->head <= arena->limit);
+    return memory;
 }
 
 
+// Holes are either 8 bytes wide (absolute addresses) or 4 bytes wide (signed,
+// usually PC-relative displacements), which not every value fits in:
+static int
+fits(int size, uintptr_t value)
+{
+    assert(size == 8 || size == 4);
+    return size == 8 || (intptr_t)value == (int32_t)value;
+}
+
 static void
-copy_and_patch(unsigned char *memory, const Stencil *stencil, uintptr_t patches[])
+patch(unsigned char *addr, int size, uintptr_t value)
+{
+    assert(fits(size, value));
+    if (size == 8) {
+        *(uintptr_t *)addr = value;
+    }
+    else {
+        *(int32_t *)addr = (int32_t)value;
+    }
+}
+
+// Each stencil's read-only data (and its GOT and PLT stubs) lives apart from
+// its code, so that the code of a whole trace can be contiguous. Hole offsets
+// past the end of the code are in the data:
+#define DATA_ALIGNMENT 16
+
+static unsigned char *
+hole_address(unsigned char *memory, unsigned char *data,
+             const Stencil *stencil, uintptr_t offset)
+{
+    if (offset < stencil->nbytes) {
+        return memory + offset;
+    }
+    assert(offset - stencil->nbytes < stencil->ndata);
+    return data + (offset - stencil->nbytes);
+}
+
+// The caller patches HOLE_base and HOLE_data to point at memory and data:
+static int
+copy_and_patch(unsigned char *memory, unsigned char *data,
+               const Stencil *stencil, uintptr_t patches[])
 {
     memcpy(memory, stencil->bytes, stencil->nbytes);
+    memcpy(data, stencil->data, stencil->ndata);
     for (size_t i = 0; i < stencil->nholes; i++) {
         const Hole *hole = &stencil->holes[i];
-        uintptr_t *addr = (uintptr_t *)(memory + hole->offset);
-        // XXX: This can't handle 32-bit relocations...
+        unsigned char *addr = hole_address(memory, data, stencil, hole->offset);
         // XXX: Use += to allow multiple relocations for one offset.
         // XXX: Get rid of pc, and replace it with HOLE_base + addend.
-        *addr = patches[hole->kind] + hole->addend + hole->pc * (uintptr_t)addr;
+        uintptr_t value = patches[hole->kind] + hole->addend + hole->pc * (uintptr_t)addr;
+        if (!fits(hole->size, value)) {
+            return -1;
+        }
+        patch(addr, hole->size, value);
     }
+    for (size_t i = 0; i < stencil->nloads; i++) {
+        const SymbolLoad *load = &stencil->loads[i];
+        unsigned char *addr = hole_address(memory, data, stencil, load->offset);
+        uintptr_t value = symbol_addresses[load->symbol] + load->addend + load->pc * (uintptr_t)addr;
+        if (!fits(load->size, value)) {
+            return -1;
+        }
+        patch(addr, load->size, value);
+    }
+    return 0;
+}
+
+// Either every hole of this kind gets patched, or none of them do:
+static int
+repatch(unsigned char *memory, unsigned char *data, const Stencil *stencil,
+        HoleKind kind, uintptr_t value)
+{
+    for (size_t i = 0; i < stencil->nholes; i++) {
+        const Hole *hole = &stencil->holes[i];
+        unsigned char *addr = hole_address(memory, data, stencil, hole->offset);
+        if (hole->kind == kind &&
+            !fits(hole->size, value + hole->addend + hole->pc * (uintptr_t)addr))
+        {
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < stencil->nholes; i++) {
+        const Hole *hole = &stencil->holes[i];
+        unsigned char *addr = hole_address(memory, data, stencil, hole->offset);
+        if (hole->kind == kind) {
+            patch(addr, hole->size, value + hole->addend + hole->pc * (uintptr_t)addr);
+        }
+    }
+    return 0;
+}
+
+// Every BB is entered from C through this (see GO_TO_TRACE in ceval_macros.h):
+_PyJITTrampoline _PyJIT_Trampoline = NULL;
+
+static int
+load_trampoline(void)
+{
+    const Stencil *stencil = &trampoline_stencil;
+    size_t nbytes = _Py_SIZE_ROUND_UP(stencil->nbytes, DATA_ALIGNMENT);
+    unsigned char *memory = mmap_near_python(nbytes + stencil->ndata);
+    if (memory == MAP_FAILED) {
+        return -1;
+    }
+    uintptr_t patches[] = GET_PATCHES();
+    patches[HOLE_base] = (uintptr_t)memory;
+    patches[HOLE_data] = (uintptr_t)memory + nbytes;
+    if (copy_and_patch(memory, memory + nbytes, stencil, patches)) {
+        MUNMAP(memory, nbytes + stencil->ndata);
+        return -1;
+    }
+    _PyJIT_Trampoline = (_PyJITTrampoline)memory;
+    return 0;
+}
+
+// Whether there is a stencil for this opcode at all. Traces stop right before
+// instructions that don't have one:
+int
+_PyJIT_CanCompile(int opcode)
+{
+    return stencils[opcode][0].nbytes != 0;
+}
+
+// Every stencil comes in variants that keep the top few stack items in
+// registers instead of reloading them (see _use_tos_caching in
+// Tools/justin/build.py). They all pass the same registers along, so any of
+// them is correct anywhere; the deepest one the stack allows is just fastest
+// (and the shallowest one is fine if nobody knows how deep it is). Interior
+// stencils skip the checks at the start of the template, and are only
+// correct right after an instruction that falls through to them:
+static const Stencil *
+get_stencil(int opcode, int stack_depth, bool interior)
+{
+    int depth = Py_MIN(Py_MAX(stack_depth, 0), MAX_TOS_DEPTH);
+    return interior ? &interior_stencils[opcode][depth] : &stencils[opcode][depth];
+}
+
+// Greedily picks the stencil for opcodes[i], which might be a superinstruction
+// that covers the next few instructions too (but never a jump target after the
+// first, since those need an entry point of their own). A BB_BRANCH can be the
+// last part of one, though, since its exits are patched wherever they are.
+// Returns how many instructions it covers:
+static int
+select_stencil(int *opcodes, int size, int i, int *stack_depths,
+               int *jump_target_trace_offsets, int n_jump_targets,
+               const Stencil **stencil)
+{
+    int depth = Py_MIN(Py_MAX(stack_depths[i], 0), MAX_TOS_DEPTH);
+    int limit = size - i;
+    // Traces are contiguous, so anything but the first instruction, a jump
+    // target, or the EXIT_TRACE sentinel at the end is reached by falling
+    // through from the one before it (if that one can't jump or call):
+    bool interior = 0 < i && i < size - 1 && falls_through[opcodes[i - 1]];
+    for (int j = 0; j < n_jump_targets; j++) {
+        int offset = jump_target_trace_offsets[j];
+        if (i < offset) {
+            limit = Py_MIN(limit, offset - i + (opcodes[offset] == BB_BRANCH));
+        }
+        if (i == jump_target_trace_offsets[j]) {
+            interior = false;
+        }
+    }
+    for (const Superinstruction *super = superinstructions; super->length; super++) {
+        if (limit < super->length) {
+            continue;
+        }
+        int length = 0;
+        while (length < super->length &&
+               opcodes[i + length] == super->opcodes[length])
+        {
+            length++;
+        }
+        if (length == super->length) {
+            *stencil = interior ? &super->interior_stencils[depth]
+                                : &super->stencils[depth];
+            return length;
+        }
+    }
+    *stencil = get_stencil(opcodes[i], stack_depths[i], interior);
+    return 1;
+}
+
+// Whatever an instruction reads from its inline cache is baked into its code
+// (see _bake_caches in Tools/justin/build.py). Each read starts at a given
+// entry, and gets up to four of them (but never past the instruction's own),
+// plus one:
+static uintptr_t
+read_cache(_Py_CODEUNIT *instruction, int opcode, int word)
+{
+    int caches = _PyOpcode_Caches[_PyOpcode_Deopt[opcode]];
+    uint64_t value = 0;
+    for (int i = Py_MIN(word + 3, caches - 1); word <= i; i--) {
+        value = (value << 16) | instruction[1 + i].cache;
+    }
+    return (uintptr_t)value + 1;
+}
+
+#define PATCH_CACHE(PATCHES, SUFFIX, INSTRUCTION, OPCODE)                       \
+    do {                                                                        \
+        (PATCHES)[HOLE_cache_1_plus_one##SUFFIX] = read_cache((INSTRUCTION), (OPCODE), 1); \
+        (PATCHES)[HOLE_cache_2_plus_one##SUFFIX] = read_cache((INSTRUCTION), (OPCODE), 2); \
+        (PATCHES)[HOLE_cache_3_plus_one##SUFFIX] = read_cache((INSTRUCTION), (OPCODE), 3); \
+        (PATCHES)[HOLE_cache_4_plus_one##SUFFIX] = read_cache((INSTRUCTION), (OPCODE), 4); \
+        (PATCHES)[HOLE_cache_5_plus_one##SUFFIX] = read_cache((INSTRUCTION), (OPCODE), 5); \
+    } while (0)
+
+// So is the constant it loads (see _bake_consts). Anything else just gets
+// zero, since it never looks:
+static uintptr_t
+read_const(PyObject *consts, _Py_CODEUNIT *instruction)
+{
+    int oparg = instruction->op.arg;
+    return oparg < PyTuple_GET_SIZE(consts)
+        ? (uintptr_t)PyTuple_GET_ITEM(consts, oparg) : 0;
+}
+
+// Most stencils end by jumping to HOLE_continue, which is just the next one in
+// the trace. So that jump can be left out, and the next stencil copied over it.
+// The last stencil (the EXIT_TRACE sentinel) has nothing after it, though:
+static size_t
+code_size(const Stencil *stencil, bool last)
+{
+    return last ? stencil->nbytes : stencil->nbytes - stencil->trailing_jump;
+}
+
+// Every stencil with exits (BB_BRANCH, BB_JUMP_BACKWARD_LAZY, and the tests
+// fused with a BB_BRANCH) gets one of these after its data, so that
+// _PyJIT_PatchExit can find the exits again later:
+typedef struct {
+    const Stencil *stencil;
+    unsigned char *data;
+} Exits;
+
+static bool
+has_exits(const Stencil *stencil)
+{
+    for (size_t i = 0; i < stencil->nholes; i++) {
+        if (stencil->holes[i].kind == HOLE_consequent) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static size_t
+data_size(const Stencil *stencil)
+{
+    size_t size = _Py_SIZE_ROUND_UP(stencil->ndata, DATA_ALIGNMENT);
+    if (has_exits(stencil)) {
+        size += _Py_SIZE_ROUND_UP(sizeof(Exits), DATA_ALIGNMENT);
+    }
+    return size;
 }
 
 // The world's smallest compiler?
-// Make sure to call _PyJIT_Free on the memory when you're done with it!
-_PyJITFunction
-_PyJIT_CompileTrace(int size, _Py_CODEUNIT **trace, int *jump_target_trace_offsets, int n_jump_targets)
+// The returned memory belongs to the arena, and lives as long as it does.
+// co is the code object being compiled, which must outlive it too.
+// opcodes[i] is what to compile trace[i] as, which isn't always what's there
+// now (tier 2 jumps rewrite themselves, but compile the same either way).
+// stack_depths[i] is the depth of the stack when trace[i] runs (or -1, if
+// nobody knows). On success, jump_target_entries[i] is the machine code for
+// the jump target at trace[jump_target_trace_offsets[i]]. If that's a jump,
+// jump_target_exits[i] is what _PyJIT_PatchExit needs to patch it (otherwise,
+// it's NULL).
+void *
+_PyJIT_CompileTrace(_PyJITArena *arena, PyCodeObject *co, int size,
+                    _Py_CODEUNIT **trace, int *opcodes, int *stack_depths,
+                    int *jump_target_trace_offsets,
+                    int n_jump_targets, void **jump_target_entries,
+                    void **jump_target_exits)
 {
     assert(size > 0);
     assert(n_jump_targets > 0);
     if (!stencils_loaded) {
         stencils_loaded = 1;
-        for (size_t i = 0; i < Py_ARRAY_LENGTH(stencils); i++) {
-            if (preload_stencil(&stencils[i])) {
-                stencils_loaded = -1;
-                break;
-            }
+        if (resolve_symbols() || load_trampoline()) {
+            stencils_loaded = -1;
         }
     }
     if (stencils_loaded < 0) {
@@ -122,62 +486,169 @@ _PyJIT_CompileTrace(int size, _Py_CODEUNIT **trace, int *jump_target_trace_offse
         return NULL;
     }
     // First, loop over everything once to find the total compiled size:
-    // size_t nbytes = trampoline_stencil.nbytes;
     size_t nbytes = 0;
-    for (int i = 0; i < size; i++) {
-        _Py_CODEUNIT *instruction = trace[i];
-        const Stencil *stencil = &stencils[instruction->op.code];
+    size_t ndata = 0;
+    int nstencils = 0;
+    for (int i = 0; i < size;) {
+        // Stencils that address the stack from the frame need to know exactly
+        // where its top is (see --static-stack in Tools/justin/build.py):
+        if (STATIC_STACK && stack_depths[i] < 0) {
+            return NULL;
+        }
+        const Stencil *stencil;
+        i += select_stencil(opcodes, size, i, stack_depths,
+                            jump_target_trace_offsets, n_jump_targets, &stencil);
         if (stencil->nbytes == 0) {
             return NULL;
         }
-        nbytes += stencil->nbytes;
+        nbytes += code_size(stencil, i == size);
+        ndata += data_size(stencil);
+        nstencils++;
     };
-    unsigned char *memory = alloc(nbytes);
+    nbytes = _Py_SIZE_ROUND_UP(nbytes, DATA_ALIGNMENT);
+    unsigned char *memory = alloc(arena, nbytes + ndata);
     if (memory == NULL) {
         return NULL;
     }
+    TraceMap *map = PyMem_Malloc(sizeof(TraceMap) + nstencils * sizeof(Placement));
+    if (map == NULL) {
+        return NULL;
+    }
+    map->nplacements = 0;
     unsigned char *head = memory;
+    unsigned char *data = memory + nbytes;
+    PyObject *consts = co->co_consts;
     uintptr_t patches[] = GET_PATCHES();
-    uintptr_t patches_entrypoint[] = GET_PATCHES();
-    //// First, the trampoline:
-    //const Stencil *stencil = &trampoline_stencil;
-    //patches[HOLE_base] = (uintptr_t)head;
-    //patches[HOLE_continue] = (uintptr_t)head + stencil->nbytes;
-    //copy_and_patch(head, stencil, patches);
-    //head += stencil->nbytes;
     // Then, all of the stencils:
     int seen_jump_targets = 0;
-    // Allocate all the entry point (trampoline) stencils,
-    unsigned char *entry_points = alloc(trampoline_stencil.nbytes * n_jump_targets);
-    unsigned char *first_entry_point = entry_points;
-    for (int i = 0; i < size; i++) {
-        // For each jump target, create an entry trampoline.
-        if (i == jump_target_trace_offsets[seen_jump_targets]) {
+    for (int i = 0; i < size;) {
+        _Py_CODEUNIT *instruction = trace[i];
+        const Stencil *stencil;
+        int length = select_stencil(opcodes, size, i, stack_depths,
+                                    jump_target_trace_offsets, n_jump_targets,
+                                    &stencil);
+        Exits *exits = NULL;
+        if (has_exits(stencil)) {
+            exits = (Exits *)(data + _Py_SIZE_ROUND_UP(stencil->ndata, DATA_ALIGNMENT));
+            exits->stencil = stencil;
+            exits->data = data;
+        }
+        // A BB that's nothing but a jump starts where the jump does, and a
+        // jump fused with the test before it is patched through the test:
+        while (seen_jump_targets < n_jump_targets &&
+               jump_target_trace_offsets[seen_jump_targets] < i + length)
+        {
+            jump_target_entries[seen_jump_targets] = head;
+            jump_target_exits[seen_jump_targets] = exits;
             seen_jump_targets++;
-            const Stencil *trampoline = &trampoline_stencil;
-            patches_entrypoint[HOLE_base] = (uintptr_t)entry_points;
-            patches_entrypoint[HOLE_continue] = (uintptr_t)head;
-            copy_and_patch(entry_points, trampoline, patches_entrypoint);
-            entry_points += trampoline->nbytes;
         }
-        _Py_CODEUNIT *instruction = trace[i];
-        const Stencil *stencil = &stencils[instruction->op.code];
+        bool last = i + length == size;
+        size_t code = code_size(stencil, last);
+        // Whatever's left of a dropped trailing jump gets copied over next:
+        assert(head + stencil->nbytes <= memory + nbytes);
         patches[HOLE_base] = (uintptr_t)head;
-        patches[HOLE_continue] = (i != size - 1)
-                               ? (uintptr_t)head + stencil->nbytes
-                               : (uintptr_t)memory + trampoline_stencil.nbytes;
+        patches[HOLE_data] = (uintptr_t)data;
+        // The last stencil (the EXIT_TRACE sentinel) never continues:
+        patches[HOLE_continue] = last ? (uintptr_t)memory
+                                      : (uintptr_t)head + code;
         patches[HOLE_next_instr] = (uintptr_t)instruction;
         patches[HOLE_oparg_plus_one] = instruction->op.arg + 1;
-        copy_and_patch(head, stencil, patches);
-        head += stencil->nbytes;
+        patches[HOLE_stack_level_plus_one] = co->co_nlocalsplus + stack_depths[i] + 1;
+        PATCH_CACHE(patches, , instruction, opcodes[i]);
+        patches[HOLE_const] = read_const(consts, instruction);
+        // The rest of a superinstruction's parts:
+        if (length > 1) {
+            patches[HOLE_next_instr_1] = (uintptr_t)trace[i + 1];
+            patches[HOLE_oparg_plus_one_1] = trace[i + 1]->op.arg + 1;
+            PATCH_CACHE(patches, _1, trace[i + 1], opcodes[i + 1]);
+            patches[HOLE_const_1] = read_const(consts, trace[i + 1]);
+        }
+        if (length > 2) {
+            patches[HOLE_next_instr_2] = (uintptr_t)trace[i + 2];
+            patches[HOLE_oparg_plus_one_2] = trace[i + 2]->op.arg + 1;
+            PATCH_CACHE(patches, _2, trace[i + 2], opcodes[i + 2]);
+            patches[HOLE_const_2] = read_const(consts, trace[i + 2]);
+        }
+        // Jump exits start out as stubs that bail to the interpreter right
+        // before the jump (the NOP or EXTENDED_ARG in front of it). See
+        // _PyJIT_PatchExit:
+        _Py_CODEUNIT *jump = trace[i + length - 1];
+        patches[HOLE_consequent] = (uintptr_t)head;
+        patches[HOLE_consequent_instr] = (uintptr_t)jump - sizeof(_Py_CODEUNIT);
+        patches[HOLE_alternative] = (uintptr_t)head;
+        patches[HOLE_alternative_instr] = (uintptr_t)jump - sizeof(_Py_CODEUNIT);
+        if (copy_and_patch(head, data, stencil, patches)) {
+            // Too far away from something it needs. The memory is lost, but
+            // the interpreter can still run the trace:
+            PyMem_Free(map);
+            return NULL;
+        }
+        Placement *placement = &map->placements[map->nplacements++];
+        placement->code = head;
+        placement->stencil = stencil;
+        placement->instruction = instruction;
+        head += code;
+        data += data_size(stencil);
+        i += length;
     };
     // Wow, done already?
-    assert(memory + nbytes == head);
+    assert(head <= memory + nbytes && memory + nbytes - head < DATA_ALIGNMENT);
+    assert(memory + nbytes + ndata == data);
     assert(seen_jump_targets == n_jump_targets);
-    assert(first_entry_point + trampoline_stencil.nbytes * n_jump_targets == entry_points);
-#ifdef Py_DEBUG
-    _PyJITFunction temp = (_PyJITFunction)first_entry_point;
-    assert(temp);
-#endif
-    return (_PyJITFunction)first_entry_point;
+    assert(map->nplacements == nstencils);
+    map->prev = arena->maps;
+    arena->maps = map;
+    return memory;
+}
+
+// Writes a line for each stencil in [code, code + size), which is some BB's
+// machine code (so some part of a trace): where it starts in the dump that has
+// that code at file_offset, which stencil it is, and the tier 2 instruction it
+// starts at (as an offset into bb_space). See _PyTier2_DumpJIT:
+void
+_PyJIT_DescribeCode(_PyJITArena *arena, FILE *out, void *code, size_t size,
+                    size_t file_offset, _PyTier2BBSpace *bb_space)
+{
+    unsigned char *start = code;
+    for (TraceMap *map = arena->maps; map != NULL; map = map->prev) {
+        for (int i = 0; i < map->nplacements; i++) {
+            Placement *placement = &map->placements[i];
+            if (placement->code < start || start + size <= placement->code) {
+                continue;
+            }
+            fprintf(out, "    0x%06zx  %-48s  tier 2 offset %d\n",
+                    file_offset + (size_t)(placement->code - start),
+                    placement->stencil->name,
+                    _PyTier2_BBSpaceOffset(bb_space, placement->instruction));
+        }
+    }
+}
+
+// Point one exit of a compiled tier 2 jump (BB_BRANCH or BB_JUMP_BACKWARD_LAZY)
+// straight at the machine code for the BB it leads to, so it no longer has to
+// go through the interpreter. The instruction goes first: an exit whose jump
+// can't reach the target still works, it just bails to the interpreter there:
+void
+_PyJIT_PatchExit(void *jump, void *jump_exits, int opcode, int successor,
+                 void *target, _Py_CODEUNIT *target_instr)
+{
+    assert(opcode == BB_BRANCH || opcode == BB_JUMP_BACKWARD_LAZY);
+    assert(successor || opcode == BB_BRANCH);
+    Exits *exits = jump_exits;
+    assert(exits && has_exits(exits->stencil));
+    const Stencil *stencil = exits->stencil;
+    if (successor) {
+        if (repatch(jump, exits->data, stencil, HOLE_consequent_instr,
+                    (uintptr_t)target_instr) == 0)
+        {
+            repatch(jump, exits->data, stencil, HOLE_consequent, (uintptr_t)target);
+        }
+    }
+    else {
+        if (repatch(jump, exits->data, stencil, HOLE_alternative_instr,
+                    (uintptr_t)target_instr) == 0)
+        {
+            repatch(jump, exits->data, stencil, HOLE_alternative, (uintptr_t)target);
+        }
+    }
 }
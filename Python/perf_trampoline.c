@@ -137,11 +137,13 @@ any DWARF information available for them).
 
 #ifdef PY_HAVE_PERF_TRAMPOLINE
 
+#include <elf.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #if defined(__arm__) || defined(__arm64__) || defined(__aarch64__)
@@ -235,35 +237,219 @@ perf_map_close(void *state)
     return ret;
 }
 
-static void
-perf_map_write_entry(void *state, const void *code_addr,
-                         unsigned int code_size, PyCodeObject *co)
+// The symbol perf shows for code belonging to co. JIT compiled code has some
+// detail about which part of co it is, too:
+static int
+perf_format_name(char *name, size_t size, PyCodeObject *co,
+                 const char *detail)
 {
-    assert(state != NULL);
-    FILE *method_file = (FILE *)state;
     const char *entry = PyUnicode_AsUTF8(co->co_qualname);
     if (entry == NULL) {
         _PyErr_WriteUnraisableMsg("Failed to get qualname from code object",
                                   NULL);
-        return;
+        return -1;
     }
     const char *filename = PyUnicode_AsUTF8(co->co_filename);
     if (filename == NULL) {
         _PyErr_WriteUnraisableMsg("Failed to get filename from code object",
                                   NULL);
-        return;
+        return -1;
+    }
+    if (detail == NULL) {
+        PyOS_snprintf(name, size, "py::%s:%s", entry, filename);
     }
-    fprintf(method_file, "%p %x py::%s:%s\n", code_addr, code_size, entry,
-            filename);
+    else {
+        PyOS_snprintf(name, size, "py::%s:%s [%s]", entry, filename, detail);
+    }
+    return 0;
+}
+
+static void
+perf_map_write_named_entry(FILE *method_file, const void *code_addr,
+                           unsigned int code_size, const char *name)
+{
+    fprintf(method_file, "%p %x %s\n", code_addr, code_size, name);
     fflush(method_file);
 }
 
+static void
+perf_map_write_entry(void *state, const void *code_addr,
+                         unsigned int code_size, PyCodeObject *co)
+{
+    assert(state != NULL);
+    char name[1024];
+    if (perf_format_name(name, sizeof(name), co, NULL) < 0) {
+        return;
+    }
+    perf_map_write_named_entry((FILE *)state, code_addr, code_size, name);
+}
+
 _PyPerf_Callbacks _Py_perfmap_callbacks = {
     &perf_map_get_file,
     &perf_map_write_entry,
     &perf_map_close
 };
 
+/* The "perf_jit" backend writes /tmp/jit-PID.dump in perf's jitdump format
+ * instead, which has a copy of the code too, so "perf annotate" can
+ * disassemble it. Run "perf inject --jit" on the recording to use it. See
+ * tools/perf/Documentation/jitdump-specification.txt in the Linux sources.
+ */
+
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JITDUMP_CODE_LOAD 0
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+} jitdump_header;
+
+typedef struct {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+    // Followed by the NUL-terminated name, then the code itself.
+} jitdump_code_load;
+
+typedef struct {
+    FILE *file;
+    // perf finds the dump through this executable mapping of it:
+    void *marker;
+    size_t marker_size;
+    uint64_t code_index;
+} jitdump_state;
+
+static uint64_t
+jitdump_timestamp(void)
+{
+    // perf has to be told to use the same clock ("perf record -k 1"):
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+jitdump_init(void)
+{
+    jitdump_state *state = PyMem_RawCalloc(1, sizeof(jitdump_state));
+    if (state == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    char filename[100];
+    pid_t pid = getpid();
+    // Same as for the perf map, but perf also needs to map it:
+    int flags = O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC;
+    snprintf(filename, sizeof(filename) - 1, "/tmp/jit-%jd.dump",
+             (intmax_t)pid);
+    int fd = open(filename, flags, 0600);
+    if (fd == -1) {
+        goto error;
+    }
+    state->marker_size = sysconf(_SC_PAGESIZE);
+    state->marker = mmap(NULL, state->marker_size, PROT_READ | PROT_EXEC,
+                         MAP_PRIVATE, fd, 0);
+    if (state->marker == MAP_FAILED) {
+        close(fd);
+        goto error;
+    }
+    state->file = fdopen(fd, "w");
+    if (state->file == NULL) {
+        munmap(state->marker, state->marker_size);
+        close(fd);
+        goto error;
+    }
+    jitdump_header header = {
+        .magic = JITDUMP_MAGIC,
+        .version = JITDUMP_VERSION,
+        .total_size = sizeof(header),
+#if defined(__x86_64__)
+        .elf_mach = EM_X86_64,
+#elif defined(__aarch64__)
+        .elf_mach = EM_AARCH64,
+#elif defined(__i386__)
+        .elf_mach = EM_386,
+#elif defined(__arm__)
+        .elf_mach = EM_ARM,
+#endif
+        .pid = (uint32_t)pid,
+        .timestamp = jitdump_timestamp(),
+    };
+    fwrite(&header, sizeof(header), 1, state->file);
+    fflush(state->file);
+    return state;
+error:
+    perf_status = PERF_STATUS_FAILED;
+    PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+    PyMem_RawFree(state);
+    return NULL;
+}
+
+static void
+jitdump_write_named_entry(jitdump_state *state, const void *code_addr,
+                          unsigned int code_size, const char *name)
+{
+    size_t name_size = strlen(name) + 1;
+    jitdump_code_load record = {
+        .id = JITDUMP_CODE_LOAD,
+        .total_size = (uint32_t)(sizeof(record) + name_size + code_size),
+        .timestamp = jitdump_timestamp(),
+        .pid = (uint32_t)getpid(),
+        .tid = (uint32_t)PyThread_get_thread_native_id(),
+        .vma = (uintptr_t)code_addr,
+        .code_addr = (uintptr_t)code_addr,
+        .code_size = code_size,
+        .code_index = state->code_index++,
+    };
+    fwrite(&record, sizeof(record), 1, state->file);
+    fwrite(name, name_size, 1, state->file);
+    fwrite(code_addr, code_size, 1, state->file);
+    fflush(state->file);
+}
+
+static void
+jitdump_write_entry(void *state, const void *code_addr,
+                    unsigned int code_size, PyCodeObject *co)
+{
+    assert(state != NULL);
+    char name[1024];
+    if (perf_format_name(name, sizeof(name), co, NULL) < 0) {
+        return;
+    }
+    jitdump_write_named_entry((jitdump_state *)state, code_addr, code_size,
+                              name);
+}
+
+static int
+jitdump_free(void *state)
+{
+    jitdump_state *jitdump = (jitdump_state *)state;
+    munmap(jitdump->marker, jitdump->marker_size);
+    int ret = fclose(jitdump->file);
+    PyMem_RawFree(jitdump);
+    perf_status = PERF_STATUS_NO_INIT;
+    return ret;
+}
+
+_PyPerf_Callbacks _Py_perfjit_callbacks = {
+    &jitdump_init,
+    &jitdump_write_entry,
+    &jitdump_free
+};
+
 static int
 new_code_arena(void)
 {
@@ -500,6 +686,29 @@ _PyPerfTrampoline_Fini(void)
     return 0;
 }
 
+void
+_PyPerfTrampoline_WriteJITCode(const void *code_addr, unsigned int code_size,
+                               PyCodeObject *co, const char *detail)
+{
+#ifdef PY_HAVE_PERF_TRAMPOLINE
+    if (perf_status != PERF_STATUS_OK || trampoline_api.state == NULL) {
+        return;
+    }
+    char name[1024];
+    if (perf_format_name(name, sizeof(name), co, detail) < 0) {
+        return;
+    }
+    if (trampoline_api.write_state == perf_map_write_entry) {
+        perf_map_write_named_entry((FILE *)trampoline_api.state, code_addr,
+                                   code_size, name);
+    }
+    else if (trampoline_api.write_state == jitdump_write_entry) {
+        jitdump_write_named_entry((jitdump_state *)trampoline_api.state,
+                                  code_addr, code_size, name);
+    }
+#endif
+}
+
 PyStatus
 _PyPerfTrampoline_AfterFork_Child(void)
 {
@@ -662,6 +662,7 @@ init_interpreter(PyInterpreterState *interp,
     _PyGC_InitState(&interp->gc);
     PyConfig_InitPythonConfig(&interp->config);
     _PyType_InitCache(interp);
+    interp->tier2_max_bb_versions = MAX_BB_VERSIONS;
 
     if (interp != &runtime->_main_interpreter) {
         /* Fix the self-referential, statically initialized fields. */
@@ -2137,6 +2137,16 @@ sys_activate_stack_trampoline_impl(PyObject *module, const char *backend)
             }
         }
     }
+    else if (strcmp(backend, "perf_jit") == 0) {
+        _PyPerf_Callbacks cur_cb;
+        _PyPerfTrampoline_GetCallbacks(&cur_cb);
+        if (cur_cb.init_state != _Py_perfjit_callbacks.init_state) {
+            if (_PyPerfTrampoline_SetCallbacks(&_Py_perfjit_callbacks) < 0 ) {
+                PyErr_SetString(PyExc_ValueError, "can't activate perf trampoline");
+                return NULL;
+            }
+        }
+    }
     else {
         PyErr_Format(PyExc_ValueError, "invalid backend: %s", backend);
         return NULL;
@@ -1,5 +1,6 @@
 #include "Python.h"
 #include "stdlib.h"
+#include "pycore_ceval.h"         // _PyPerfTrampoline_WriteJITCode
 #include "pycore_code.h"
 #include "pycore_frame.h"
 #include "pycore_opcode.h"
@@ -7,18 +8,58 @@
 #include "pycore_long.h"
 #include "stdbool.h"
 #include "pycore_jit.h"
-#include "jit_stencils.h"
 
 #include "opcode.h"
+#include "opcode_metadata.h"      // _PyOpcode_num_popped/pushed
 
 
 #define BB_DEBUG 0
 #define TYPEPROP_DEBUG 0
 #define JIT_DEBUG 0
-// Max typed version basic blocks per basic block
-#define MAX_BB_VERSIONS 10
+// How many times the tier 2 interpreter enters a BB before it gets compiled
+#ifndef JIT_WARMUP
+#define JIT_WARMUP 16
+#endif
+// How many times a region's machine code bails out on failed guards before it
+// is thrown away and compiled again (see _PyTier2_JITDeopt)
+#ifndef JIT_DEOPT_THRESHOLD
+#define JIT_DEOPT_THRESHOLD 64
+#endif
+// How many times a region gets compiled before it's left to the interpreter
+#define JIT_MAX_COMPILES 4
+// How many times in a row a loop's back edge has to be taken without any new
+// BBs being generated before the loop gets compiled as one superblock, how
+// many times it's taken at most while waiting for that, and how many regions
+// a superblock can have (see jit_loop_back_edge)
+#ifndef JIT_LOOP_WARMUP
+#define JIT_LOOP_WARMUP 8
+#endif
+#define JIT_LOOP_PATIENCE 256
+#define JIT_MAX_LOOP_REGIONS 16
+
+// objdump's name for the architecture of the machine code (see
+// _PyTier2_DumpJIT)
+#if defined(__x86_64__) || defined(_M_X64)
+#define JIT_OBJDUMP_ARCH "i386:x86-64"
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define JIT_OBJDUMP_ARCH "aarch64"
+#else
+#define JIT_OBJDUMP_ARCH "<arch>"
+#endif
 
-#define OVERALLOCATE_FACTOR 20
+// How big the first chunk of the BB space is, relative to the bytecode (but
+// at least BB_SPACE_MIN_SIZE bytes, since small functions are mostly branches,
+// which grow a lot). The rest are twice as big as the one before them (see
+// _PyTier2_BBSpaceCheckAndReallocIfNeeded).
+#define OVERALLOCATE_FACTOR 2
+#define BB_SPACE_MIN_SIZE 512
+// How many more code units an instruction can turn into than it has in tier 1:
+// a LOAD_FAST of a boxed float becomes four instructions, and the float may be
+// reboxed later (each value is reboxed at most once).
+#define BB_SPACE_EXPANSION 4
+// How many code units the branch (or jump, type guard, scope exit) at the end
+// of a BB can take up, at most (see emit_logical_branch).
+#define BB_SPACE_BRANCH 16
 #define MAX_JUMP_TARGETS_PER_BB 256
 
 static _Py_CODEUNIT EXIT_TRACE_SENTINEL = {
@@ -28,57 +69,351 @@ static _Py_CODEUNIT EXIT_TRACE_SENTINEL = {
     }
 };
 
+static inline int IS_SCOPE_EXIT_OPCODE(int opcode);
+static inline int IS_JUMP_OPCODE(int opcode);
+
 ////////// JIT FUNCTIONS
 
 /**
- * @brief This function JIT compiles a given starting BB's tier 2 instructions.
- * Then populates the metadata with the machine code (assuming it is compilable).
- * 
- * @param bb The BB to start compiling from.
- * @param codeunits Total number of code units from the start to trace until.
- * @param jump_target_metadata BB metadata of the jump targets within this trace.
+ * @brief Tier 2 jumps rewrite themselves once they know where they go (see
+ * _PyTier2_RewriteForwardJump and _PyTier2_RewriteBackwardJump), which is
+ * usually before their BB gets hot enough to compile. Their machine code
+ * doesn't care, and just bails to the tier 2 interpreter right before the jump
+ * until its exits are patched.
+ * @param opcode Opcode of the instruction in the tier 2 code.
+ * @return The opcode to compile it as.
+*/
+static inline int
+jit_opcode(int opcode)
+{
+    switch (opcode) {
+    case BB_BRANCH_IF_FLAG_SET:
+    case BB_BRANCH_IF_FLAG_UNSET:
+    case BB_JUMP_IF_FLAG_SET:
+    case BB_JUMP_IF_FLAG_UNSET:
+        return BB_BRANCH;
+    // Tier 2 code only has these where a BB_JUMP_BACKWARD_LAZY used to be,
+    // since _PyTier2_Code_DetectAndEmitBB follows the tier 1 JUMP_FORWARDs:
+    case JUMP_BACKWARD_QUICK:
+    case JUMP_FORWARD:
+        return BB_JUMP_BACKWARD_LAZY;
+    default:
+        return opcode;
+    }
+}
+
+/**
+ * @brief Points one exit of a compiled jump straight at the machine code of the
+ * BB it leads to, if both have some.
+ * @param meta The BB the jump ends.
+ * @param opcode The jump the BB was compiled with (BB_BRANCH or
+ * BB_JUMP_BACKWARD_LAZY), even if it has rewritten itself since.
+ * @param successor Which exit to patch (consequent or alternative).
+ * @param target The BB the exit leads to (or NULL, if it hasn't been generated).
+*/
+static void
+link_jit_exit(_PyTier2BBMetadata *meta, int opcode, int successor,
+    _PyTier2BBMetadata *target)
+{
+    if (target == NULL || meta->exit_machine_code == NULL ||
+        target->machine_code == NULL) {
+        return;
+    }
+    // Back edges of loops that are still warming up are left alone (see
+    // jit_loop_back_edge). Jumps to a BB that ends no later than this one
+    // are back edges:
+    if (opcode == BB_JUMP_BACKWARD_LAZY && target->tier1_end <= meta->tier1_end &&
+        target->jit_region->jit_loop_warmup >= 0)
+    {
+        return;
+    }
+#if JIT_DEBUG
+    fprintf(stderr, "JIT: patching %s exit of %p to %p\n",
+        successor ? "consequent" : "alternative", meta->exit_machine_code,
+        target->machine_code);
+#endif
+    _PyJIT_PatchExit(meta->exit_machine_code, meta->exit_machine_data, opcode,
+        successor,
+        target->machine_code, target->tier2_start);
+}
+
+/**
+ * @brief Checks whether the machine code for an instruction reads its oparg
+ * when it runs (so an EXTENDED_ARG in front of it can be compiled too), or
+ * doesn't use one at all. Everything else has its oparg burned in.
+ * @param opcode Opcode of the instruction following the EXTENDED_ARG.
+ * @return Whether the EXTENDED_ARG can be part of a trace.
+*/
+static inline int
+JIT_HANDLES_EXTENDED_ARG(int opcode)
+{
+    switch (opcode) {
+    case BB_TEST_POP_IF_FALSE:
+    case BB_TEST_POP_IF_TRUE:
+    case BB_TEST_POP_IF_NOT_NONE:
+    case BB_TEST_POP_IF_NONE:
+    case BB_TEST_ITER:
+    case BB_TEST_ITER_LIST:
+    case BB_TEST_ITER_RANGE:
+    case BB_TEST_ITER_TUPLE:
+    case BB_BRANCH:
+    case BB_BRANCH_IF_FLAG_SET:
+    case BB_BRANCH_IF_FLAG_UNSET:
+    case BB_JUMP_IF_FLAG_SET:
+    case BB_JUMP_IF_FLAG_UNSET:
+    case BB_JUMP_BACKWARD_LAZY:
+    case JUMP_BACKWARD_QUICK:
+    case JUMP_FORWARD:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Finds the BB that one exit of the jump at the end of a trace leads to.
+ * @param t2_info The tier 2 info of the code object.
+ * @param jump The jump instruction.
+ * @param successor Which exit (consequent or alternative).
+ * @return The BB, or NULL if it hasn't been generated yet.
+*/
+static _PyTier2BBMetadata *
+jit_exit_target(_PyTier2Info *t2_info, _Py_CODEUNIT *jump, int successor)
+{
+    _PyBBBranchCache *cache = (_PyBBBranchCache *)(jump + 1);
+    if (jump->op.code != JUMP_FORWARD) {
+        return (_PyTier2BBMetadata *)(successor ? read_obj(cache->consequent_bb)
+                                                : read_obj(cache->alternative_bb));
+    }
+    // A rewritten BB_JUMP_BACKWARD_LAZY, so the prefix is always there:
+    int oparg = jump[-1].op.code == EXTENDED_ARG ? jump[-1].op.arg << 8 : 0;
+    _Py_CODEUNIT *target = jump + 1 + (oparg | jump->op.arg);
+    for (int i = 0; i < t2_info->bb_data_curr; i++) {
+        if (t2_info->bb_data[i]->tier2_start == target) {
+            return t2_info->bb_data[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Finds where a compiled BB starts in the tier 1 code.
+ * @param co The code object.
+ * @param meta The BB.
+ * @return The first tier 1 instruction the BB covers.
+*/
+static _Py_CODEUNIT *
+jit_bb_tier1_start(PyCodeObject *co, _PyTier2BBMetadata *meta)
+{
+    _PyTier2BBMetadata *first = meta->jit_region;
+    return meta == first
+        ? first->jit_region_tier1_start
+        : co->_tier2_info->bb_data[meta->id - 1]->tier1_end;
+}
+
+/**
+ * @brief Tells perf (if it's listening, see Python/perf_trampoline.c) which BB
+ * some machine code belongs to.
+ * @param co The code object.
+ * @param meta The BB.
+ * @param code_size How much machine code the BB has.
+*/
+static void
+jit_register_bb(PyCodeObject *co, _PyTier2BBMetadata *meta,
+    unsigned int code_size)
+{
+    _Py_CODEUNIT *tier1_start = jit_bb_tier1_start(co, meta);
+    char detail[64];
+    PyOS_snprintf(detail, sizeof(detail), "tier 2 BB %d, tier 1 offsets %d-%d",
+        meta->id,
+        (int)((tier1_start - _PyCode_CODE(co)) * sizeof(_Py_CODEUNIT)),
+        (int)((meta->tier1_end - _PyCode_CODE(co)) * sizeof(_Py_CODEUNIT)));
+    _PyPerfTrampoline_WriteJITCode(meta->machine_code, code_size, co, detail);
+}
+
+/**
+ * @brief Compiles a trace and hands its entry points to the BBs that start in
+ * it. A trace is usually one straight line of code ending in a jump, but can
+ * be several of those back to back (see jit_compile_loop). Every jump in it
+ * belongs to the BB it ends.
+ * @param co The code object. Its tier 2 info owns the executable memory.
+ * @param trace The instructions to compile, with room for one more at the end.
+ * @param opcodes What to compile each instruction as (see jit_opcode).
+ * @param stack_depths The depth of the stack at each instruction in the trace.
+ * @param written len(trace)
+ * @param jump_target_trace_offsets Where each of the jump targets starts in the trace.
+ * @param jump_target_metadata BB metadata of the jump targets in the trace.
  * @param jump_target_count len(jump_target_metadata)
- * @param before_branch The last code unit in the BB before the branch instruction.
- * @return 0 on success, -1 on failure
+ * @return 1 if it was compiled, 0 if it's left to the interpreter, -1 on
+ * failure
 */
-int
-jit_compile(
-    _PyTier2BBMetadata *bb,
-    int codeunits,
-    _PyTier2BBMetadata *jump_target_metadata[MAX_JUMP_TARGETS_PER_BB],
-    int jump_target_count,
-    _Py_CODEUNIT *before_branch
+static int
+jit_compile_trace(
+    PyCodeObject *co,
+    _Py_CODEUNIT **trace,
+    int *opcodes,
+    int *stack_depths,
+    int written,
+    int *jump_target_trace_offsets,
+    _PyTier2BBMetadata **jump_target_metadata,
+    int jump_target_count
 )
 {
-#if JIT_DEBUG
-    fprintf(stderr, "JIT: JIT COMPILING TRACE WITH THE FOLLOWING JUMP TARGETS: ");
-    for (int x = 0; x < jump_target_count; x++) {
-        fprintf(stderr, "%p, ", jump_target_metadata[x]->tier2_start);
+    // Nothing to compile, or too short to make it worth it!
+    if (written <= 2) {
+        return 0;
     }
-    fprintf(stderr, "\n");
-#endif
-    int jump_target_trace_offsets[MAX_JUMP_TARGETS_PER_BB] = { 0 };
+    _PyTier2Info *t2_info = co->_tier2_info;
+    // Write a sentinel EXIT_TRACE to tell it to bail
+    trace[written] = &EXIT_TRACE_SENTINEL;
+    opcodes[written] = EXIT_TRACE;
+    stack_depths[written] = 0;
+    written++;
+    assert(jump_target_count > 0);
+    assert(jump_target_trace_offsets[0] == 0);
+    // Besides the jump targets, we also need to know where each jump ended up
+    // (to patch it), and where the BBs' code ends (for perf). In order:
+    int entry_offsets[2 * MAX_JUMP_TARGETS_PER_BB + 1];
+    // The BB each entry belongs to, or NULL for the EXIT_TRACE sentinel:
+    _PyTier2BBMetadata *entry_metadata[2 * MAX_JUMP_TARGETS_PER_BB + 1];
+    bool entry_is_jump[2 * MAX_JUMP_TARGETS_PER_BB + 1];
+    void *entries[2 * MAX_JUMP_TARGETS_PER_BB + 1];
+    void *entries_exits[2 * MAX_JUMP_TARGETS_PER_BB + 1];
+    int n_entries = 0;
     int seen_jump_targets = 0;
-    int codeunits_before_branch = (int)(before_branch - bb->tier2_start);
-    // Prepare the JIT by removing all the CACHE entries. The JIT only takes a nice
-    // instruction array without any of the CACHE entries.
-    _Py_CODEUNIT **trace = PyMem_Malloc(codeunits * sizeof(_Py_CODEUNIT *));
-    if (trace == NULL) {
-        return -1;
+    for (int i = 0; i < written - 1; i++) {
+        if (seen_jump_targets < jump_target_count &&
+            i == jump_target_trace_offsets[seen_jump_targets])
+        {
+            entry_offsets[n_entries] = i;
+            entry_metadata[n_entries] = jump_target_metadata[seen_jump_targets];
+            entry_is_jump[n_entries] = false;
+            n_entries++;
+            seen_jump_targets++;
+        }
+        if (opcodes[i] == BB_BRANCH || opcodes[i] == BB_JUMP_BACKWARD_LAZY) {
+            assert(seen_jump_targets > 0);
+            entry_offsets[n_entries] = i;
+            entry_metadata[n_entries] = jump_target_metadata[seen_jump_targets - 1];
+            entry_is_jump[n_entries] = true;
+            n_entries++;
+        }
     }
-    int written = 0;
-    for (int i = 0; i < codeunits_before_branch; i++) {
-        _Py_CODEUNIT *curr = bb->tier2_start + i;
-        int caches = _PyOpcode_Caches[_PyOpcode_Deopt[curr->op.code]];
+    assert(seen_jump_targets == jump_target_count);
+    entry_offsets[n_entries] = written - 1;
+    entry_metadata[n_entries] = NULL;
+    entry_is_jump[n_entries] = false;
+    n_entries++;
+    if (t2_info->_jit_arena == NULL) {
+        t2_info->_jit_arena = _PyJIT_NewArena();
+        if (t2_info->_jit_arena == NULL) {
+            return -1;
+        }
+    }
+    void *machine_code = _PyJIT_CompileTrace(
+        t2_info->_jit_arena, co, written, trace, opcodes,
+        stack_depths, entry_offsets, n_entries, entries, entries_exits);
+    if (machine_code == NULL) {
+        // Not compilable. Leave the BBs to the tier 2 interpreter.
+        return 0;
+    }
+    // Each BB's code runs up to wherever the next one's starts:
+    void *end = entries[n_entries - 1];
+    for (int i = n_entries - 2; i >= 0; i--) {
+        if (!entry_is_jump[i]) {
+            _PyTier2BBMetadata *meta = entry_metadata[i];
+            meta->machine_code = entries[i];
+            meta->machine_code_size = (char *)end - (char *)entries[i];
+            jit_register_bb(co, meta, (unsigned int)meta->machine_code_size);
+            end = entries[i];
+        }
+    }
+    // Whichever exits of the jumps have been taken already lead somewhere
+    // (maybe even somewhere compiled, like elsewhere in this trace):
+    for (int i = 0; i < n_entries - 1; i++) {
+        if (!entry_is_jump[i]) {
+            continue;
+        }
+        _PyTier2BBMetadata *meta = entry_metadata[i];
+        _Py_CODEUNIT *jump = trace[entry_offsets[i]];
+        int opcode = opcodes[entry_offsets[i]];
+        meta->exit_machine_code = entries[i];
+        meta->exit_machine_data = entries_exits[i];
+        meta->exit_instr = jump;
+        link_jit_exit(meta, opcode, 1, jit_exit_target(t2_info, jump, 1));
+        if (opcode == BB_BRANCH) {
+            link_jit_exit(meta, opcode, 0, jit_exit_target(t2_info, jump, 0));
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Appends part of a region to a trace: from the given instruction up to
+ * and including the jump that ends the region, or up to the first instruction
+ * that can't be compiled (or a scope exit, which is left to the interpreter).
+ * @param bb The first BB of the region.
+ * @param i Where to start, in code units from bb->tier2_start. Set to where it
+ * stopped.
+ * @param codeunits Total number of code units from the start to trace until.
+ * @param depth The depth of the stack at i (or -1, if we lost track, which makes
+ * the machine code slower, or leaves it to the interpreter if the stencils
+ * address the stack from the frame). Kept up to date.
+ * @param bbs BB metadata of the jump targets within the region.
+ * @param bb_count len(bbs)
+ * @param seen_bbs How many of bbs start before i. Kept up to date.
+ * @param trace The trace to append to.
+ * @param opcodes What to compile each instruction in it as.
+ * @param stack_depths The depth of the stack at each instruction in it.
+ * @param written len(trace), kept up to date.
+ * @param jump_target_trace_offsets Where each of the BBs in the trace starts in
+ * it. Appended to.
+ * @param jump_target_metadata BB metadata of the BBs in the trace. Appended to.
+ * @param jump_target_count len(jump_target_metadata), kept up to date.
+ * @return Whether it got stuck on an instruction that can't be compiled.
+*/
+static bool
+jit_append_to_trace(
+    _PyTier2BBMetadata *bb,
+    int *i,
+    int codeunits,
+    int *depth,
+    _PyTier2BBMetadata **bbs,
+    int bb_count,
+    int *seen_bbs,
+    _Py_CODEUNIT **trace,
+    int *opcodes,
+    int *stack_depths,
+    int *written,
+    int *jump_target_trace_offsets,
+    _PyTier2BBMetadata **jump_target_metadata,
+    int *jump_target_count
+)
+{
+    for (; *i < codeunits; (*i)++) {
+        _Py_CODEUNIT *curr = bb->tier2_start + *i;
+        int opcode = jit_opcode(curr->op.code);
+        // Scope exits are left to the tier 2 interpreter.
+        if (IS_SCOPE_EXIT_OPCODE(opcode)) {
+            return false;
+        }
+        if (!_PyJIT_CanCompile(opcode) ||
+            (opcode == EXTENDED_ARG &&
+             (*i + 1 == codeunits || !JIT_HANDLES_EXTENDED_ARG(curr[1].op.code)))) {
+            return true;
+        }
+        bool is_branch = false;
+        int caches = _PyOpcode_Caches[_PyOpcode_Deopt[opcode]];
         if (caches == 0) {
             // Check one more time to be sure. Might be a tier 2 op with cache.
-            switch (curr->op.code) {
+            switch (opcode) {
             case BB_BRANCH:
             case BB_BRANCH_IF_FLAG_SET:
             case BB_BRANCH_IF_FLAG_UNSET:
             case BB_JUMP_IF_FLAG_SET:
             case BB_JUMP_IF_FLAG_UNSET:
                 caches = INLINE_CACHE_ENTRIES_BB_BRANCH;
+                is_branch = true;
                 break;
             case BB_TEST_ITER:
             case BB_TEST_ITER_LIST:
@@ -88,6 +423,7 @@ jit_compile(
                 break;
             case BB_JUMP_BACKWARD_LAZY:
                 caches = INLINE_CACHE_ENTRIES_JUMP_BACKWARD;
+                is_branch = true;
                 break;
             default:
                 caches = 0;
@@ -95,43 +431,215 @@ jit_compile(
             }
         }
         // Find all offsets of the jump targets in the trace
-        if (seen_jump_targets < jump_target_count &&
-            curr == jump_target_metadata[seen_jump_targets]->tier2_start) {
-            jump_target_trace_offsets[seen_jump_targets] = written;
-            seen_jump_targets++;
+        if (*seen_bbs < bb_count && curr == bbs[*seen_bbs]->tier2_start) {
+            jump_target_trace_offsets[*jump_target_count] = *written;
+            jump_target_metadata[*jump_target_count] = bbs[*seen_bbs];
+            (*jump_target_count)++;
+            // Each BB's type context is the one at its end, which is
+            // where the next one starts:
+            if (*seen_bbs > 0) {
+                _PyTier2TypeContext *prev = bbs[*seen_bbs - 1]->type_context;
+                *depth = (int)(prev->type_stack_ptr - prev->type_stack);
+            }
+            (*seen_bbs)++;
         }
 #if (JIT_DEBUG) && defined(Py_DEBUG)
         fprintf(stderr, "JIT: added to trace %s, instr %p\n", _PyOpcode_OpName[curr->op.code], curr);
 #endif
-        trace[written] = curr;
-        written++;
-        i += caches;
+        trace[*written] = curr;
+        opcodes[*written] = opcode;
+        stack_depths[*written] = *depth;
+        (*written)++;
+        if (*depth >= 0) {
+            int oparg = curr->op.arg;
+            if (*written > 1 && trace[*written - 2]->op.code == EXTENDED_ARG) {
+                oparg |= trace[*written - 2]->op.arg << 8;
+            }
+            int popped = _PyOpcode_num_popped(opcode, oparg, false);
+            int pushed = _PyOpcode_num_pushed(opcode, oparg, false);
+            *depth = (popped < 0 || pushed < 0) ? -1 : *depth - popped + pushed;
+        }
+        *i += caches;
+        // Anything after the branch is only reachable by jumping to it.
+        if (is_branch) {
+            return false;
+        }
     }
-    // Nothing to compile, or too short to make it worth it!
-    if (written <= 2) {
+    return false;
+}
+
+/**
+ * @brief This function JIT compiles a given starting BB's tier 2 instructions.
+ * Then populates the metadata with the machine code (assuming it is compilable).
+ *
+ * Traces run up to and including the branch that ends the BB. That branch
+ * jumps straight into the machine code of the BB it goes to, so control only
+ * returns to the interpreter at scope exits, on deopts, for BBs that couldn't
+ * be compiled, the first time each exit of a jump is taken (see
+ * _PyTier2_EnterBB), and when the eval breaker is set on a back edge.
+ *
+ * A trace stops right before an instruction that can't be compiled; the next
+ * one starts at the first jump target after it. That way a loop header still
+ * gets machine code when whatever sets up the loop (usually a LOAD_GLOBAL and
+ * a CALL to get the iterable) doesn't.
+ *
+ * The machine code for each instruction is picked by how deep the stack is
+ * there (see _PyJIT_CompileTrace), which is tracked from the start of each BB.
+ * 
+ * @param co The code object. Its tier 2 info owns the executable memory.
+ * @param bb The BB to start compiling from.
+ * @param stack_depth The depth of the stack at the start of bb.
+ * @param codeunits Total number of code units from the start to trace until.
+ * @param jump_target_metadata BB metadata of the jump targets within this trace.
+ * @param jump_target_count len(jump_target_metadata)
+ * @return 0 on success, -1 on failure
+*/
+int
+jit_compile(
+    PyCodeObject *co,
+    _PyTier2BBMetadata *bb,
+    int stack_depth,
+    int codeunits,
+    _PyTier2BBMetadata *jump_target_metadata[MAX_JUMP_TARGETS_PER_BB],
+    int jump_target_count
+)
+{
+#if JIT_DEBUG
+    fprintf(stderr, "JIT: JIT COMPILING TRACE WITH THE FOLLOWING JUMP TARGETS: ");
+    for (int x = 0; x < jump_target_count; x++) {
+        fprintf(stderr, "%p, ", jump_target_metadata[x]->tier2_start);
+    }
+    fprintf(stderr, "\n");
+#endif
+    int jump_target_trace_offsets[MAX_JUMP_TARGETS_PER_BB] = { 0 };
+    _PyTier2BBMetadata *trace_metadata[MAX_JUMP_TARGETS_PER_BB];
+    int seen_jump_targets = 0;
+    // Prepare the JIT by removing all the CACHE entries. The JIT only takes a nice
+    // instruction array without any of the CACHE entries.
+    // + 1 for the EXIT_TRACE sentinel.
+    _Py_CODEUNIT **trace = PyMem_Malloc((codeunits + 1) * sizeof(_Py_CODEUNIT *));
+    int *opcodes = PyMem_Malloc((codeunits + 1) * sizeof(int));
+    int *stack_depths = PyMem_Malloc((codeunits + 1) * sizeof(int));
+    if (trace == NULL || opcodes == NULL || stack_depths == NULL) {
         PyMem_Free(trace);
-        return 0;
+        PyMem_Free(opcodes);
+        PyMem_Free(stack_depths);
+        return -1;
     }
-    assert(written != 0);
-    // Write a sentinel EXIT_TRACE to tell it to bail
-    trace[written] = &EXIT_TRACE_SENTINEL;
-    written++;
-    assert(jump_target_trace_offsets[0] == 0);
-    assert(seen_jump_targets <= jump_target_count);
-    /*
-    *This createA memory region of an array of trampoline(entry) stencils, corresponding to each
-    * jump target.If the jump target is uncompilable(e.g.a branch instruction),
-    * it will be left out of this memory region.
-    */
-    unsigned char *entry_points = (unsigned char *)_PyJIT_CompileTrace(written, trace, jump_target_trace_offsets, seen_jump_targets);
-    for (int i = 0; i < seen_jump_targets; i++) {
-        jump_target_metadata[i]->machine_code = (void *)entry_points;
-        entry_points += trampoline_stencil.nbytes;
+    int depth = stack_depth;
+    int i = 0;
+    while (i < codeunits) {
+        int written = 0;
+        int trace_jump_targets = 0;
+        bool stuck = jit_append_to_trace(bb, &i, codeunits, &depth,
+            jump_target_metadata, jump_target_count, &seen_jump_targets,
+            trace, opcodes, stack_depths, &written,
+            jump_target_trace_offsets, trace_metadata, &trace_jump_targets);
+        if (jit_compile_trace(co, trace, opcodes, stack_depths, written,
+                              jump_target_trace_offsets, trace_metadata,
+                              trace_jump_targets) < 0) {
+            PyMem_Free(trace);
+            PyMem_Free(opcodes);
+            PyMem_Free(stack_depths);
+            return -1;
+        }
+        if (!stuck) {
+            break;
+        }
+        // Skip ahead to the next BB after the instruction we got stuck on,
+        // which can be jumped to directly. Jump targets that no trace reaches
+        // are left to the interpreter.
+        while (seen_jump_targets < jump_target_count &&
+               jump_target_metadata[seen_jump_targets]->tier2_start <= bb->tier2_start + i) {
+            seen_jump_targets++;
+        }
+        if (seen_jump_targets == jump_target_count) {
+            break;
+        }
+        i = (int)(jump_target_metadata[seen_jump_targets]->tier2_start - bb->tier2_start);
     }
     PyMem_Free(trace);
+    PyMem_Free(opcodes);
+    PyMem_Free(stack_depths);
     return 0;
 }
 
+/**
+ * @brief Writes the machine code of a code object's BBs to a file, back to
+ * back, for objdump -D -b binary to disassemble. Next to it, path + ".map"
+ * says where each BB starts in it, where C code enters it (through
+ * _PyJIT_Trampoline), and which stencil each part of it is.
+ * @param co The code object.
+ * @param path Where to write the machine code.
+ * @return How many BBs had machine code, or -1 (with an exception set) on
+ * failure.
+*/
+int
+_PyTier2_DumpJIT(PyCodeObject *co, const char *path)
+{
+    _PyTier2Info *t2_info = co->_tier2_info;
+    const char *qualname = PyUnicode_AsUTF8(co->co_qualname);
+    const char *filename = PyUnicode_AsUTF8(co->co_filename);
+    if (qualname == NULL || filename == NULL) {
+        return -1;
+    }
+    size_t path_len = strlen(path);
+    char *map_path = PyMem_Malloc(path_len + sizeof(".map"));
+    if (map_path == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memcpy(map_path, path, path_len);
+    memcpy(map_path + path_len, ".map", sizeof(".map"));
+    FILE *bin = fopen(path, "wb");
+    if (bin == NULL) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        PyMem_Free(map_path);
+        return -1;
+    }
+    FILE *map = fopen(map_path, "w");
+    if (map == NULL) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, map_path);
+        fclose(bin);
+        PyMem_Free(map_path);
+        return -1;
+    }
+    fprintf(map, "# Machine code of %s (%s:%d). To disassemble it:\n",
+        qualname, filename, co->co_firstlineno);
+    fprintf(map, "# objdump -D -b binary -m %s %s\n", JIT_OBJDUMP_ARCH, path);
+    fprintf(map, "# C code enters each BB through the trampoline at %p.\n",
+        (void *)_PyJIT_Trampoline);
+    int dumped = 0;
+    size_t offset = 0;
+    for (int i = 0; t2_info != NULL && i < t2_info->bb_data_curr; i++) {
+        _PyTier2BBMetadata *meta = t2_info->bb_data[i];
+        if (meta == NULL || meta->machine_code == NULL) {
+            continue;
+        }
+        _Py_CODEUNIT *tier1_start = jit_bb_tier1_start(co, meta);
+        fprintf(map, "BB %d (tier 1 offsets %d-%d): entry %p, %zu bytes at file "
+            "offset 0x%06zx\n",
+            meta->id,
+            (int)((tier1_start - _PyCode_CODE(co)) * sizeof(_Py_CODEUNIT)),
+            (int)((meta->tier1_end - _PyCode_CODE(co)) * sizeof(_Py_CODEUNIT)),
+            meta->machine_code, meta->machine_code_size, offset);
+        _PyJIT_DescribeCode(t2_info->_jit_arena, map, meta->machine_code,
+            meta->machine_code_size, offset, t2_info->_bb_space);
+        fwrite(meta->machine_code, 1, meta->machine_code_size, bin);
+        offset += meta->machine_code_size;
+        dumped++;
+    }
+    int failed = ferror(bin) | ferror(map);
+    failed |= fclose(bin) | fclose(map);
+    if (failed) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        PyMem_Free(map_path);
+        return -1;
+    }
+    PyMem_Free(map_path);
+    return dumped;
+}
+
 /* Dummy types used by the types propagator */
 
 // Represents a 64-bit unboxed double
@@ -149,8 +657,6 @@ PyTypeObject PySmallInt_Type = {
 };
 
 
-static inline int IS_SCOPE_EXIT_OPCODE(int opcode);
-
 ////////// TYPE NODES FUNCTIONS
 
 /**
@@ -974,27 +1480,84 @@ type_propagate(
 ////////// BB SPACE FUNCTIONS
 
 /**
- * @brief Creates the overallocated array for the BBs.
+ * @brief Creates a chunk of the overallocated array for the BBs.
+ * @param prev The chunk before it (or NULL, if it's the first one).
  * @param space_to_alloc How much space to allocate.
  * @return A new space that we can write basic block instructions to.
 */
 static _PyTier2BBSpace *
-_PyTier2_CreateBBSpace(Py_ssize_t space_to_alloc)
+_PyTier2_CreateBBSpace(_PyTier2BBSpace *prev, Py_ssize_t space_to_alloc)
 {
     _PyTier2BBSpace *bb_space = PyMem_Malloc(space_to_alloc + sizeof(_PyTier2BBSpace));
     if (bb_space == NULL) {
         return NULL;
     }
+    bb_space->prev = prev;
+    bb_space->start = prev == NULL ? 0 : prev->start + prev->water_level;
     bb_space->water_level = 0;
     bb_space->max_capacity = space_to_alloc;
     return bb_space;
 }
 
 /**
- * @brief Checks if there's enough space in the basic block space for space_requested.
+ * @brief Frees every chunk of a BB space.
+ * @param bb_space The last chunk.
+*/
+void
+_PyTier2_FreeBBSpace(_PyTier2BBSpace *bb_space)
+{
+    while (bb_space != NULL) {
+        _PyTier2BBSpace *prev = bb_space->prev;
+        PyMem_Free(bb_space);
+        bb_space = prev;
+    }
+}
+
+/**
+ * @brief Works out how much space _PyTier2_Code_DetectAndEmitBB could need to
+ * emit the BB starting at a tier 1 instruction, by scanning ahead the same way
+ * it does until the first branch or scope exit.
+ * @param co The code object.
+ * @param tier1_start Where the BB starts in the tier 1 code.
+ * @return The space needed (in bytes).
+*/
+static Py_ssize_t
+bb_space_needed(PyCodeObject *co, _Py_CODEUNIT *tier1_start)
+{
+    Py_ssize_t codeunits = BB_SPACE_BRANCH + co->co_stacksize;
+    int oparg = 0;
+    for (Py_ssize_t i = tier1_start - _PyCode_CODE(co); i < Py_SIZE(co); i++) {
+        _Py_CODEUNIT *curr = _PyCode_CODE(co) + i;
+        int opcode = _PyOpcode_Deopt[_Py_OPCODE(*curr)];
+        oparg = oparg << 8 | _Py_OPARG(*curr);
+        if (opcode == EXTENDED_ARG) {
+            codeunits++;
+            continue;
+        }
+        if (opcode == JUMP_FORWARD) {
+            i += oparg;
+        }
+        else if (IS_JUMP_OPCODE(opcode) || IS_SCOPE_EXIT_OPCODE(opcode)) {
+            break;
+        }
+        else {
+            int caches = _PyOpcode_Caches[opcode];
+            codeunits += 1 + caches + BB_SPACE_EXPANSION;
+            i += caches;
+        }
+        oparg = 0;
+    }
+    return codeunits * sizeof(_Py_CODEUNIT);
+}
+
+/**
+ * @brief Checks if there's enough space in the basic block space for
+ * space_requested, and adds a chunk to it if there isn't. BBs never straddle
+ * two chunks, but jumps between them can't be relative (see
+ * _PyTier2_BBJumpDistance).
  * @param co The code object's tier2 basic block space to check
  * @param space_requested The amount of extra space you need.
- * @return The space of the code object after checks.
+ * @return The space of the code object after checks, or NULL on failure.
 */
 static _PyTier2BBSpace *
 _PyTier2_BBSpaceCheckAndReallocIfNeeded(PyCodeObject *co, Py_ssize_t space_requested)
@@ -1005,17 +1568,61 @@ _PyTier2_BBSpaceCheckAndReallocIfNeeded(PyCodeObject *co, Py_ssize_t space_reque
     // Over max capacity
     if (curr->water_level + space_requested > curr->max_capacity) {
         // Note: overallocate
-        Py_ssize_t new_size = sizeof(_PyTier2BBSpace) + (curr->water_level + space_requested) * 2;
+        Py_ssize_t new_size = Py_MAX(curr->max_capacity * 2, space_requested);
 #if BB_DEBUG
-        fprintf(stderr, "Space requested: %lld, Allocating new BB of size %lld\n", (int64_t)space_requested, (int64_t)new_size);
+        fprintf(stderr, "Space requested: %lld, Allocating new BB space chunk of size %lld\n", (int64_t)space_requested, (int64_t)new_size);
 #endif
-        // @TODO We can't Realloc, we actually need to do the linked list method.
-        Py_UNREACHABLE();
+        curr = _PyTier2_CreateBBSpace(curr, new_size);
+        if (curr == NULL) {
+            return NULL;
+        }
+        co->_tier2_info->_bb_space = curr;
     }
-    // We have enouogh space. Don't do anything, j
     return curr;
 }
 
+/**
+ * @brief Finds the chunk of the BB space that a tier 2 instruction is in.
+ * @param t2_info The tier 2 info of the code object.
+ * @param instr The instruction.
+ * @return The chunk, or NULL if it isn't in any of them.
+*/
+static _PyTier2BBSpace *
+bb_space_chunk_of(_PyTier2Info *t2_info, _Py_CODEUNIT *instr)
+{
+    for (_PyTier2BBSpace *space = t2_info->_bb_space; space != NULL;
+         space = space->prev)
+    {
+        if (space->u_code <= instr &&
+            (char *)instr < (char *)space->u_code + space->water_level)
+        {
+            return space;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Works out how far a tier 2 jump has to jump to get to a BB, if it can
+ * get there with a relative jump at all: it can't once they are in different
+ * chunks of the BB space, or more than 0xFFFF code units apart. Those jumps
+ * go through the target's metadata instead.
+ * @param co The code object.
+ * @param from Where the jump jumps from (after the PC is incremented).
+ * @param to The jump target.
+ * @return The number of code units to jump by, or 0 if that can't be done.
+*/
+int
+_PyTier2_BBJumpDistance(PyCodeObject *co, _Py_CODEUNIT *from, _Py_CODEUNIT *to)
+{
+    _PyTier2BBSpace *space = bb_space_chunk_of(co->_tier2_info, from);
+    if (space == NULL || bb_space_chunk_of(co->_tier2_info, to) != space) {
+        return 0;
+    }
+    Py_ssize_t distance = to - from;
+    return -0xFFFF <= distance && distance <= 0xFFFF ? (int)distance : 0;
+}
+
 //// BB METADATA FUNCTIONS
 
 /**
@@ -1041,6 +1648,21 @@ allocate_bb_metadata(PyCodeObject *co, _Py_CODEUNIT *tier2_start,
     }
 
     metadata->machine_code = NULL;
+    metadata->machine_code_size = 0;
+    metadata->exit_machine_code = NULL;
+    metadata->exit_machine_data = NULL;
+    metadata->exit_instr = NULL;
+    metadata->jit_warmup = JIT_WARMUP;
+    metadata->jit_region = NULL;
+    metadata->jit_region_size = 0;
+    metadata->jit_region_stack_depth = 0;
+    metadata->jit_region_codeunits = 0;
+    metadata->jit_region_tier1_start = NULL;
+    metadata->jit_region_deopts = 0;
+    metadata->jit_region_compiles = 0;
+    metadata->jit_loop_warmup = JIT_LOOP_WARMUP;
+    metadata->jit_loop_bb_count = 0;
+    metadata->jit_loop_patience = JIT_LOOP_PATIENCE;
     metadata->tier2_start = tier2_start;
     metadata->tier1_end = tier1_end;
     metadata->type_context = type_context;
@@ -1333,6 +1955,9 @@ write_bb_id(_PyBBBranchCache *cache, int bb_id, bool is_type_guard) {
     // Make sure MSB is unset, because we need to shift it.
     assert((bb_id & 0x8000) == 0);
     cache->bb_id_tagged = MAKE_TAGGED_BB_ID((uint16_t)bb_id, is_type_guard);
+    // No machine code to jump to yet.
+    write_obj(cache->consequent_bb, NULL);
+    write_obj(cache->alternative_bb, NULL);
 }
 
 
@@ -1655,7 +2280,8 @@ add_metadata_to_jump_2d_array(_PyTier2Info *t2_info, int target_bb_id,
     assert(found);
     int jump_i = 0;
     found = false;
-    for (; jump_i < MAX_BB_VERSIONS; jump_i++) {
+    // (Never the generic version's slot, see _PyTier2_LocateJumpBackwardsBB.)
+    for (; jump_i < t2_info->max_bb_versions; jump_i++) {
         if (t2_info->backward_jump_target_bb_pairs[backward_jump_offset_index][jump_i].id ==
             -1) {
 #if BB_DEBUG
@@ -1937,7 +2563,6 @@ _PyTier2_Code_DetectAndEmitBB(
 #define DISPATCH_GOTO() goto dispatch_opcode;
 #define TYPECONST_GET_RAWTYPE(idx) Py_TYPE(PyTuple_GET_ITEM(consts, idx))
 #define GET_CONST(idx) PyTuple_GET_ITEM(consts, idx)
-#define SET_BEFORE_BRANCH() before_branch = write_i - 1;
 #define CHECK_BACKWARDS_JUMP_TARGET() \
     if (!checked_jump_target) { \
     from_another_opcode = true;\
@@ -1958,9 +2583,11 @@ _PyTier2_Code_DetectAndEmitBB(
     _PyTier2Info *t2_info = co->_tier2_info;
     PyObject *consts = co->co_consts;
     _Py_CODEUNIT *t2_start = (_Py_CODEUNIT *)(((char *)bb_space->u_code) + bb_space->water_level);
-    _Py_CODEUNIT *t2_original_start = t2_start;
     _Py_CODEUNIT *write_i = t2_start;
     int tos = -1;
+    // For the JIT:
+    int start_stack_depth = (int)(starting_type_context->type_stack_ptr -
+        starting_type_context->type_stack);
 
     // For handling of backwards jumps
     bool starts_with_backwards_jump_target = false;
@@ -1971,10 +2598,6 @@ _PyTier2_Code_DetectAndEmitBB(
     bool from_another_opcode = false;
     bool checked_jump_target = false;
 
-    // For JIT compilation
-
-    _Py_CODEUNIT *before_branch = NULL;
-
     // A meta-interpreter for types.
     Py_ssize_t i = (tier1_start - _PyCode_CODE(co));
     for (; i < Py_SIZE(co); i++) {
@@ -2159,7 +2782,6 @@ _PyTier2_Code_DetectAndEmitBB(
         case BINARY_OP:
             CHECK_BACKWARDS_JUMP_TARGET();
             if (oparg == NB_ADD || oparg == NB_SUBTRACT || oparg == NB_MULTIPLY) {
-                SET_BEFORE_BRANCH();
                 // Add operation. Need to check if we can infer types.
                 _Py_CODEUNIT *possible_next = infer_BINARY_OP(t2_start,
                     oparg, &needs_guard,
@@ -2183,7 +2805,6 @@ _PyTier2_Code_DetectAndEmitBB(
             DISPATCH_REBOX(2);
         case BINARY_SUBSCR: {
             CHECK_BACKWARDS_JUMP_TARGET();
-            SET_BEFORE_BRANCH();
             _Py_CODEUNIT *possible_next = infer_BINARY_SUBSCR(
                 t2_start, oparg, &needs_guard,
                 *curr,
@@ -2205,7 +2826,6 @@ _PyTier2_Code_DetectAndEmitBB(
         }
         case STORE_SUBSCR: {
             CHECK_BACKWARDS_JUMP_TARGET();
-            SET_BEFORE_BRANCH();
             _Py_CODEUNIT *possible_next = infer_BINARY_SUBSCR(
                 t2_start, oparg, &needs_guard,
                 *curr,
@@ -2329,7 +2949,6 @@ _PyTier2_Code_DetectAndEmitBB(
             if (IS_SCOPE_EXIT_OPCODE(opcode)) {
                 // Emit the scope exit instruction.
                 write_i = emit_scope_exit(write_i, *curr, starting_type_context);
-                SET_BEFORE_BRANCH();
                 END();
             }
 
@@ -2347,7 +2966,6 @@ _PyTier2_Code_DetectAndEmitBB(
                     JUMPBY(oparg);
                     continue;
                 }
-                SET_BEFORE_BRANCH();
                 // Get the BB ID without incrementing it.
                 // AllocateBBMetaData will increment.
                 write_i = emit_logical_branch(starting_type_context, write_i, *curr,
@@ -2383,16 +3001,23 @@ _PyTier2_Code_DetectAndEmitBB(
     }
     // Tell BB space the number of bytes we wrote.
     bb_space->water_level += (write_i - t2_start) * sizeof(_Py_CODEUNIT);
+    // See bb_space_needed:
+    assert(bb_space->water_level <= bb_space->max_capacity);
 #if BB_DEBUG
     fprintf(stderr, "Generated BB T2 Start: %p, T1 offset: %zu\n", metas[0]->tier2_start,
         metas[0]->tier1_end - _PyCode_CODE(co));
 #endif
     assert(metas_size >= 0);
-    // JIT compile the bb
-    if (jit_compile(metas[0], (int)(write_i - t2_original_start), metas,
-        metas_size + 1, before_branch) < 0) {
-        return NULL;
+    // Remember what to JIT compile once any of these BBs gets hot (see
+    // _PyTier2_EnterBB).
+    for (int k = 0; k <= metas_size; k++) {
+        assert(metas[k]->id == metas[0]->id + k);
+        metas[k]->jit_region = metas[0];
     }
+    metas[0]->jit_region_size = metas_size + 1;
+    metas[0]->jit_region_stack_depth = start_stack_depth;
+    metas[0]->jit_region_codeunits = (int)(write_i - metas[0]->tier2_start);
+    metas[0]->jit_region_tier1_start = tier1_start;
     // Return the first BB
     return metas[0];
 
@@ -2410,21 +3035,23 @@ compare_ints(const void *a, const void *b)
 /**
  * @brief Allocates the 2D array required to store information about backwards jump targets.
  * @param backwards_jump_count How many backwards jump targets there are.
+ * @param max_bb_versions How many type-specialised versions each target can have
+ * (there's one more slot for the generic version).
  * @param backward_jump_target_bb_pairs Triplet information required about the backward jump target. 
  * @return 0 on success 1 on error.
 */
 static int
-allocate_jump_offset_2d_array(int backwards_jump_count,
+allocate_jump_offset_2d_array(int backwards_jump_count, int max_bb_versions,
     _PyTier2BBStartTypeContextTriplet **backward_jump_target_bb_pairs)
 {
     int done = 0;
     for (int i = 0; i < backwards_jump_count; i++) {
         _PyTier2BBStartTypeContextTriplet *pair =
-            PyMem_Malloc(sizeof(_PyTier2BBStartTypeContextTriplet) * MAX_BB_VERSIONS);
+            PyMem_Malloc(sizeof(_PyTier2BBStartTypeContextTriplet) * (max_bb_versions + 1));
         if (pair == NULL) {
             goto error;
         }
-        for (int i = 0; i < MAX_BB_VERSIONS; i++) {
+        for (int i = 0; i <= max_bb_versions; i++) {
             pair[i].id = -1;
         }
         done++;
@@ -2448,6 +3075,9 @@ static int
 _PyCode_Tier2FillJumpTargets(PyCodeObject *co)
 {
     assert(co->_tier2_info != NULL);
+    // Later changes to the interpreter's cap don't resize the arrays below.
+    co->_tier2_info->max_bb_versions =
+        _PyInterpreterState_GET()->tier2_max_bb_versions;
     // Count all the backwards jump targets.
     Py_ssize_t backwards_jump_count = 0;
     for (Py_ssize_t i = 0; i < Py_SIZE(co); i++) {
@@ -2482,7 +3112,7 @@ _PyCode_Tier2FillJumpTargets(PyCodeObject *co)
         return 1;
     }
     if (allocate_jump_offset_2d_array((int)backwards_jump_count,
-        backward_jump_target_bb_pairs)) {
+        co->_tier2_info->max_bb_versions, backward_jump_target_bb_pairs)) {
         PyMem_Free(backward_jump_offsets);
         PyMem_Free(backward_jump_target_bb_pairs);
         return 1;
@@ -2559,6 +3189,7 @@ _PyTier2Info_Initialize(PyCodeObject *co)
 
     t2_info->backward_jump_count = 0;
     t2_info->backward_jump_offsets = NULL;
+    t2_info->_jit_arena = NULL;
 
     // Initialize BB data array
     t2_info->bb_data_len = 0;
@@ -2699,9 +3330,11 @@ _PyCode_Tier2Initialize(_PyInterpreterFrame *frame, _Py_CODEUNIT *next_instr)
     fprintf(stderr, "INITIALIZING\n");
 #endif
 
-    Py_ssize_t space_to_alloc = (_PyCode_NBYTES(co)) * OVERALLOCATE_FACTOR;
+    Py_ssize_t space_to_alloc = Py_MAX(_PyCode_NBYTES(co) * OVERALLOCATE_FACTOR,
+        BB_SPACE_MIN_SIZE);
+    space_to_alloc = Py_MAX(space_to_alloc, bb_space_needed(co, _PyCode_CODE(co)));
 
-    _PyTier2BBSpace *bb_space = _PyTier2_CreateBBSpace(space_to_alloc);
+    _PyTier2BBSpace *bb_space = _PyTier2_CreateBBSpace(NULL, space_to_alloc);
     if (bb_space == NULL) {
         PyMem_Free(t2_info);
         return NULL;
@@ -2738,7 +3371,7 @@ _PyCode_Tier2Initialize(_PyInterpreterFrame *frame, _Py_CODEUNIT *next_instr)
 
 cleanup:
     PyMem_Free(t2_info);
-    PyMem_Free(bb_space);
+    _PyTier2_FreeBBSpace(bb_space);
     return NULL;
 }
 
@@ -2807,12 +3440,8 @@ _PyTier2_GenerateNextBBMetaWithTypeContext(
     _Py_CODEUNIT *tier1_end = custom_tier1_end == NULL
         ? meta->tier1_end + jumpby : custom_tier1_end;
     *tier1_fallback = tier1_end;
-    // Be a pessimist and assume we need to write the entire rest of code into the BB.
-    // The size of the BB generated will definitely be equal to or smaller than this.
     _PyTier2BBSpace *space = _PyTier2_BBSpaceCheckAndReallocIfNeeded(
-        frame->f_code,
-        _PyCode_NBYTES(co) -
-        (tier1_end - _PyCode_CODE(co)) * sizeof(_Py_CODEUNIT));
+        frame->f_code, bb_space_needed(co, tier1_end));
     if (space == NULL) {
         // DEOPTIMIZE TO TIER 1?
         return NULL;
@@ -3127,10 +3756,112 @@ diff_typecontext(_PyTier2TypeContext *ctx1, _PyTier2TypeContext *ctx2)
     return diff;
 }
 
+/**
+ * @brief Boxes every unboxed value in a frame's locals and on its operand stack,
+ * so that it can carry on in code that doesn't know their types.
+ * @param frame The current executing frame.
+ * @param type_context The type context describing the frame's values.
+ * @return How many values were boxed, or -1 on error.
+*/
+static int
+rebox_frame(_PyInterpreterFrame *frame, _PyTier2TypeContext *type_context)
+{
+    PyObject **stack_base = _PyFrame_Stackbase(frame);
+    int stack_elems = (int)(type_context->type_stack_ptr - type_context->type_stack);
+    int reboxed = 0;
+    for (int i = 0; i < type_context->type_locals_len; i++) {
+        if (is_unboxed_typenode(type_context->type_locals[i])) {
+            PyObject *boxed = PyFloat_FromDouble(*(double *)&frame->localsplus[i]);
+            if (boxed == NULL) {
+                return -1;
+            }
+            frame->localsplus[i] = boxed;
+            reboxed++;
+        }
+    }
+    for (int i = 0; i < stack_elems; i++) {
+        if (is_unboxed_typenode(type_context->type_stack[i])) {
+            PyObject *boxed = PyFloat_FromDouble(*(double *)&stack_base[i]);
+            if (boxed == NULL) {
+                return -1;
+            }
+            stack_base[i] = boxed;
+            reboxed++;
+        }
+    }
+    return reboxed;
+}
+
+/**
+ * @brief Locates the generic version of a backwards jump target, generating it
+ * if needed. It doesn't assume anything about the types of the frame's values,
+ * so any jump can go there, once the values it has unboxed are boxed again.
+ * 
+ * @param frame The current executing frame.
+ * @param curr_type_context The type context at the jump.
+ * @param jump_offset_id Which backwards jump target it is.
+ * @param source_bb_id A BB starting at the target, to generate from.
+ * @param tier1_start The tier 1 instruction the target starts at.
+ * @param tier1_fallback Signals the tier 1 instruction to fall back to should generation fail.
+ * @param keep_lazy Set if the jump had to box values, which it then has to do every time.
+ * @return The generic version's metadata.
+*/
+static _PyTier2BBMetadata *
+locate_generic_jump_target_bb(_PyInterpreterFrame *frame,
+    _PyTier2TypeContext *curr_type_context, int jump_offset_id, int source_bb_id,
+    _Py_CODEUNIT *tier1_start, _Py_CODEUNIT **tier1_fallback, int *keep_lazy)
+{
+    PyCodeObject *co = frame->f_code;
+    _PyTier2Info *t2_info = co->_tier2_info;
+    _PyTier2BBStartTypeContextTriplet *generic =
+        &t2_info->backward_jump_target_bb_pairs[jump_offset_id][t2_info->max_bb_versions];
+    // (Also makes falling back to tier 1 safe, should generation fail.)
+    int reboxed = rebox_frame(frame, curr_type_context);
+    if (reboxed < 0) {
+        return NULL;
+    }
+    *keep_lazy = reboxed > 0;
+    if (generic->id >= 0) {
+        return t2_info->bb_data[generic->id];
+    }
+#if BB_DEBUG
+    fprintf(stderr, "Generating generic jump target BB\n");
+#endif
+    _PyTier2TypeContext *type_context = initialize_type_context(co);
+    if (type_context == NULL) {
+        return NULL;
+    }
+    type_context->type_stack_ptr +=
+        curr_type_context->type_stack_ptr - curr_type_context->type_stack;
+    _PyTier2TypeContext *type_context_copy = _PyTier2TypeContext_Copy(type_context);
+    if (type_context_copy == NULL) {
+        _PyTier2TypeContext_Free(type_context);
+        return NULL;
+    }
+    _PyTier2BBMetadata *meta = _PyTier2_GenerateNextBBMetaWithTypeContext(
+        frame, MAKE_TAGGED_BB_ID(source_bb_id, 0),
+        NULL,
+        0,
+        tier1_fallback,
+        0,
+        type_context,
+        tier1_start);
+    if (meta == NULL) {
+        _PyTier2TypeContext_Free(type_context);
+        _PyTier2TypeContext_Free(type_context_copy);
+        return NULL;
+    }
+    generic->id = meta->id;
+    generic->start_type_context = type_context_copy;
+    generic->tier1_start = tier1_start;
+    return meta;
+}
+
 /**
  * @brief Locate the BB corresponding to a backwards jump target. Matches also the type context.
  * If it fails to find a matching type context, a new backwards jump BB is generated with
- * more specific type context.
+ * more specific type context. Once the target has max_bb_versions of those, the
+ * generic version is used instead (see locate_generic_jump_target_bb).
  * 
  * @param frame The current executing frame.
  * @param bb_id_tagged The tagged version of the BB_ID (see macros above to understand).
@@ -3138,12 +3869,13 @@ diff_typecontext(_PyTier2TypeContext *ctx1, _PyTier2TypeContext *ctx2)
  * @param tier1_fallback Signals the tier 1 instruction to fall back to should generation fail.
  * @param curr Current executing instruction
  * @param stacklevel The stack level of the operand stack.
+ * @param keep_lazy Set if the jump shouldn't be rewritten to go to the BB directly.
  * @return The target BB's metadata.
 */
 _PyTier2BBMetadata *
 _PyTier2_LocateJumpBackwardsBB(_PyInterpreterFrame *frame, uint16_t bb_id_tagged, int jumpby,
     _Py_CODEUNIT **tier1_fallback,
-    _Py_CODEUNIT *curr, int stacklevel)
+    _Py_CODEUNIT *curr, int stacklevel, int *keep_lazy)
 {
     PyCodeObject *co = frame->f_code;
     assert(co->_tier2_info != NULL);
@@ -3158,16 +3890,7 @@ _PyTier2_LocateJumpBackwardsBB(_PyInterpreterFrame *frame, uint16_t bb_id_tagged
     // The jump target
     _Py_CODEUNIT *tier1_jump_target = meta->tier1_end + jumpby;
     *tier1_fallback = tier1_jump_target;
-    // Be a pessimist and assume we need to write the entire rest of code into the BB.
-    // The size of the BB generated will definitely be equal to or smaller than this.
-    _PyTier2BBSpace *space = _PyTier2_BBSpaceCheckAndReallocIfNeeded(
-        frame->f_code,
-        _PyCode_NBYTES(co) -
-        (tier1_jump_target - _PyCode_CODE(co)) * sizeof(_Py_CODEUNIT));
-    if (space == NULL) {
-        // DEOPTIMIZE TO TIER 1?
-        return NULL;
-    }
+    // (If a new BB has to be generated, that checks for space itself.)
 
     // Get type_context of previous BB
     _PyTier2TypeContext *curr_type_context = meta->type_context;
@@ -3192,7 +3915,7 @@ _PyTier2_LocateJumpBackwardsBB(_PyInterpreterFrame *frame, uint16_t bb_id_tagged
             fprintf(stderr, "jump offset matched: %d\n", t2_info->backward_jump_offsets[i]);
 #endif
             jump_offset_id = i;
-            for (int x = 0; x < MAX_BB_VERSIONS; x++) {
+            for (int x = 0; x < t2_info->max_bb_versions; x++) {
                 int target_bb_id = t2_info->backward_jump_target_bb_pairs[i][x].id;
 #if BB_DEBUG
                 fprintf(stderr, "jump offset bb id considered: %d\n", target_bb_id);
@@ -3226,6 +3949,12 @@ _PyTier2_LocateJumpBackwardsBB(_PyInterpreterFrame *frame, uint16_t bb_id_tagged
     // We couldn't find a matching BB to jump to. Time to generate our own.
     // This also requires rewriting our backwards jump to a forward jump later.
     if (matching_bb_id == -1) {
+        // Out of versions?
+        if (t2_info->backward_jump_target_bb_pairs[jump_offset_id][t2_info->max_bb_versions - 1].id >= 0) {
+            return locate_generic_jump_target_bb(frame, curr_type_context,
+                jump_offset_id, candidate_bb_id, candidate_bb_tier1_start,
+                tier1_fallback, keep_lazy);
+        }
 #if BB_DEBUG
         fprintf(stderr, "Generating new jump target BB ID: %d\n", matching_bb_id);
 #endif
@@ -3251,10 +3980,11 @@ _PyTier2_LocateJumpBackwardsBB(_PyInterpreterFrame *frame, uint16_t bb_id_tagged
             _PyTier2TypeContext_Free(second_copy);
             return NULL;
         }
-        // Store the metadata in the jump ids.
+        // Store the metadata in the jump ids. Generating it may have already
+        // taken the last free slot, in which case it's found through there.
         assert(t2_info->backward_jump_offsets[jump_offset_id] == jump_offset);
         bool found = false;
-        for (int x = 0; x < MAX_BB_VERSIONS; x++) {
+        for (int x = 0; x < t2_info->max_bb_versions; x++) {
             int target_bb_id = t2_info->backward_jump_target_bb_pairs[jump_offset_id][x].id;
             // Write to an available space
             if (target_bb_id < 0) {
@@ -3265,7 +3995,9 @@ _PyTier2_LocateJumpBackwardsBB(_PyInterpreterFrame *frame, uint16_t bb_id_tagged
                 break;
             }
         }
-        assert(found);
+        if (!found) {
+            _PyTier2TypeContext_Free(second_copy);
+        }
         return meta;
     }
     assert(matching_bb_id >= 0);
@@ -3291,23 +4023,29 @@ _PyTier2_LocateJumpBackwardsBB(_PyInterpreterFrame *frame, uint16_t bb_id_tagged
  * BB_JUMP_IF_FLAG_SET
  * CACHE
  * 
+ * Unless the target is out of reach (see _PyTier2_BBJumpDistance). Then the
+ * branch stays as it is, and finds the target in its cache from now on.
  * Backwards jumps are handled by another function.
  * 
+ * @param co The code object.
  * @param bb_branch Whether the next BB to execute is the consequent/alternative BB.
  * @param target The jump target.
 */
 void
-_PyTier2_RewriteForwardJump(_Py_CODEUNIT *bb_branch, _Py_CODEUNIT *target)
+_PyTier2_RewriteForwardJump(PyCodeObject *co, _Py_CODEUNIT *bb_branch,
+    _Py_CODEUNIT *target)
 {
     int branch = _Py_OPCODE(*bb_branch);
     assert(branch == BB_BRANCH_IF_FLAG_SET ||
         branch == BB_BRANCH_IF_FLAG_UNSET);
     _Py_CODEUNIT *write_curr = bb_branch - 1;
-    // -1 because the PC is auto incremented
-    int oparg = (int)(target - bb_branch - 1);
+    // +1 because the PC is auto incremented
+    int oparg = _PyTier2_BBJumpDistance(co, bb_branch + 1, target);
+    if (oparg == 0) {
+        return;
+    }
     assert(oparg > 0);
     bool requires_extended = oparg > 0xFF;
-    assert(oparg <= 0xFFFF);
     if (requires_extended) {
         _py_set_opcode(write_curr, EXTENDED_ARG);
         write_curr->op.arg = (oparg >> 8) & 0xFF;
@@ -3342,12 +4080,16 @@ _PyTier2_RewriteForwardJump(_Py_CODEUNIT *bb_branch, _Py_CODEUNIT *target)
  * CACHE xn
  * END_FOR
  * 
+ * Unless the target is out of reach (see _PyTier2_BBJumpDistance). Then the
+ * jump stays lazy, and finds the target in its cache from now on.
+ * 
+ * @param co The code object.
  * @param jump_backward_lazy The backwards jump instruction.
- * @param target The target we're jumping to.
  * @param meta The target's BB metadata.
 */
 void
-_PyTier2_RewriteBackwardJump(_Py_CODEUNIT *jump_backward_lazy, _Py_CODEUNIT *target, _PyTier2BBMetadata *meta)
+_PyTier2_RewriteBackwardJump(PyCodeObject *co, _Py_CODEUNIT *jump_backward_lazy,
+    _PyTier2BBMetadata *meta)
 {
     _Py_CODEUNIT *write_curr = jump_backward_lazy - 1;
     _Py_CODEUNIT *prev = jump_backward_lazy - 1;
@@ -3356,15 +4098,19 @@ _PyTier2_RewriteBackwardJump(_Py_CODEUNIT *jump_backward_lazy, _Py_CODEUNIT *tar
         _Py_OPCODE(*prev) == NOP);
 
     // +1 because we increment the PC before JUMPBY
-    int oparg = (int)(target - (jump_backward_lazy + 1));
-    assert(oparg != 0);
+    int oparg = _PyTier2_BBJumpDistance(co, jump_backward_lazy + 1,
+        meta->tier2_start);
     // Is backwards jump.
     bool is_backwards_jump = oparg < 0;
     if (is_backwards_jump) {
         oparg = -oparg+INLINE_CACHE_ENTRIES_JUMP_BACKWARD;
     }
+    if (oparg == 0 || oparg > 0xFFFF) {
+        _PyBBBranchCache *cache = (_PyBBBranchCache *)(jump_backward_lazy + 1);
+        write_obj(cache->consequent_bb, (PyObject *)meta);
+        return;
+    }
     assert(oparg > 0);
-    assert(oparg <= 0xFFFF);
 
     bool requires_extended = oparg > 0xFF;
     if (requires_extended) {
@@ -3382,13 +4128,323 @@ _PyTier2_RewriteBackwardJump(_Py_CODEUNIT *jump_backward_lazy, _Py_CODEUNIT *tar
         : JUMP_FORWARD);
     write_curr->op.arg = oparg & 0xFF;
     write_curr++;
+    // The JIT finds the target through this. JUMP_FORWARD has no cache as far
+    // as dis is concerned, so its stays zeroed (see jit_exit_target):
     _PyBBBranchCache *cache = (_PyBBBranchCache *)write_curr;
-    if (meta != NULL && is_backwards_jump) {
-        write_obj(cache->consequent_trace, (PyObject *)meta->machine_code);
+    if (is_backwards_jump) {
+        write_obj(cache->consequent_bb, (PyObject *)meta);
     }
     return;
 }
 
+/**
+ * @brief Repoints every compiled exit that leads into a region: either at the
+ * region's machine code (after it has been compiled again), or back at the
+ * stub it started out as, which bails to the tier 2 interpreter.
+ * @param t2_info The tier 2 info of the code object.
+ * @param first The first BB of the region.
+ * @param unlink Whether to point them back at their stubs.
+*/
+static void
+relink_jit_exits_to(_PyTier2Info *t2_info, _PyTier2BBMetadata *first,
+    bool unlink)
+{
+    for (int i = 0; i < t2_info->bb_data_curr; i++) {
+        _PyTier2BBMetadata *meta = t2_info->bb_data[i];
+        if (meta->exit_machine_code == NULL) {
+            continue;
+        }
+        int opcode = jit_opcode(meta->exit_instr->op.code);
+        for (int successor = 1; successor >= 0; successor--) {
+            if (successor == 0 && opcode != BB_BRANCH) {
+                break;
+            }
+            _PyTier2BBMetadata *target =
+                jit_exit_target(t2_info, meta->exit_instr, successor);
+            if (target == NULL || target->jit_region != first) {
+                continue;
+            }
+            if (unlink) {
+                // See _PyJIT_CompileTrace:
+                _PyJIT_PatchExit(meta->exit_machine_code,
+                    meta->exit_machine_data, opcode, successor,
+                    meta->exit_machine_code, meta->exit_instr - 1);
+            }
+            else {
+                link_jit_exit(meta, opcode, successor, target);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Compiles the regions of a loop that already have machine code into
+ * one superblock: a single trace, with each region's code right after the one
+ * before it, and every exit between them jumping straight to the other's code.
+ * Only exits that leave the loop (or lead somewhere that couldn't be compiled)
+ * go anywhere else. The regions' old machine code stays in the arena, but
+ * nothing leads there anymore.
+ *
+ * The regions are laid out in the order they're reached from the loop header,
+ * following each branch's consequent first.
+ *
+ * @param co The code object.
+ * @param header The BB the loop's back edge jumps to.
+ * @param latch The BB that ends with the back edge.
+ * @return 1 if it was compiled, 0 if it's left as it is, -1 on failure
+*/
+static int
+jit_compile_loop(PyCodeObject *co, _PyTier2BBMetadata *header,
+    _PyTier2BBMetadata *latch)
+{
+    _PyTier2Info *t2_info = co->_tier2_info;
+    _Py_CODEUNIT *loop_start = header->jit_region->jit_region_tier1_start;
+    _PyTier2BBMetadata *regions[JIT_MAX_LOOP_REGIONS];
+    int n_regions = 0;
+    // Each region found pushes at most two more:
+    _PyTier2BBMetadata *todo[2 * JIT_MAX_LOOP_REGIONS + 1];
+    int n_todo = 0;
+    int bb_count = 0;
+    int codeunits = 0;
+    bool has_latch = false;
+    todo[n_todo++] = header->jit_region;
+    while (n_todo > 0) {
+        _PyTier2BBMetadata *first = todo[--n_todo];
+        bool seen = false;
+        for (int i = 0; i < n_regions; i++) {
+            seen |= regions[i] == first;
+        }
+        _PyTier2BBMetadata *last =
+            t2_info->bb_data[first->id + first->jit_region_size - 1];
+        // Only regions in the loop that were compiled all the way through to
+        // the jump at their end:
+        if (seen || first->machine_code == NULL ||
+            last->exit_machine_code == NULL ||
+            first->jit_region_tier1_start < loop_start ||
+            last->tier1_end > latch->tier1_end)
+        {
+            continue;
+        }
+        if (n_regions == JIT_MAX_LOOP_REGIONS ||
+            bb_count + first->jit_region_size > MAX_JUMP_TARGETS_PER_BB)
+        {
+            return 0;
+        }
+        regions[n_regions++] = first;
+        bb_count += first->jit_region_size;
+        codeunits += first->jit_region_codeunits;
+        has_latch |= last == latch;
+        int opcode = jit_opcode(last->exit_instr->op.code);
+        for (int successor = 0; successor <= 1; successor++) {
+            if (successor == 0 && opcode != BB_BRANCH) {
+                continue;
+            }
+            _PyTier2BBMetadata *target =
+                jit_exit_target(t2_info, last->exit_instr, successor);
+            if (target != NULL) {
+                todo[n_todo++] = target->jit_region;
+            }
+        }
+    }
+    // Nothing to gain from a loop that's just one region:
+    if (!has_latch || n_regions < 2) {
+        return 0;
+    }
+#if JIT_DEBUG
+    fprintf(stderr, "JIT: compiling the loop at BB %d as %d regions\n",
+        header->id, n_regions);
+#endif
+    int jump_target_trace_offsets[MAX_JUMP_TARGETS_PER_BB];
+    _PyTier2BBMetadata *trace_metadata[MAX_JUMP_TARGETS_PER_BB];
+    int trace_jump_targets = 0;
+    int written = 0;
+    // + 1 for the EXIT_TRACE sentinel.
+    _Py_CODEUNIT **trace = PyMem_Malloc((codeunits + 1) * sizeof(_Py_CODEUNIT *));
+    int *opcodes = PyMem_Malloc((codeunits + 1) * sizeof(int));
+    int *stack_depths = PyMem_Malloc((codeunits + 1) * sizeof(int));
+    int result = 1;
+    if (trace == NULL || opcodes == NULL || stack_depths == NULL) {
+        result = -1;
+    }
+    for (int r = 0; result > 0 && r < n_regions; r++) {
+        _PyTier2BBMetadata *first = regions[r];
+        int i = 0;
+        int depth = first->jit_region_stack_depth;
+        int seen_bbs = 0;
+        bool stuck = jit_append_to_trace(first, &i,
+            first->jit_region_codeunits, &depth,
+            &t2_info->bb_data[first->id], first->jit_region_size, &seen_bbs,
+            trace, opcodes, stack_depths, &written,
+            jump_target_trace_offsets, trace_metadata, &trace_jump_targets);
+        // It was compiled all the way through before, so it should be again:
+        if (stuck || seen_bbs < first->jit_region_size || written == 0 ||
+            (opcodes[written - 1] != BB_BRANCH &&
+             opcodes[written - 1] != BB_JUMP_BACKWARD_LAZY))
+        {
+            result = 0;
+        }
+    }
+    if (result > 0) {
+        result = jit_compile_trace(co, trace, opcodes, stack_depths, written,
+            jump_target_trace_offsets, trace_metadata, trace_jump_targets);
+    }
+    PyMem_Free(trace);
+    PyMem_Free(opcodes);
+    PyMem_Free(stack_depths);
+    if (result <= 0) {
+        return result;
+    }
+    // The exits inside the superblock are linked already. Everything else
+    // that leads into it still points at the old code:
+    for (int r = 0; r < n_regions; r++) {
+        regions[r]->jit_region_deopts = 0;
+        regions[r]->jit_region_compiles++;
+        relink_jit_exits_to(t2_info, regions[r], false);
+    }
+    return 1;
+}
+
+/**
+ * @brief Called when the tier 2 interpreter takes a back edge to a loop header
+ * that has machine code. Each BB of a loop only gets compiled with the rest of
+ * its region, so a loop's machine code starts out in pieces, spread around
+ * the arena. Once no new BBs have been generated for JIT_LOOP_WARMUP times
+ * around the loop in a row, the loop's versions have probably settled, and
+ * its regions get compiled again as one superblock (see jit_compile_loop).
+ * Until then, the back edge stays unlinked (see link_jit_exit), so it keeps
+ * coming through here.
+ * A loop doesn't wait more than JIT_LOOP_PATIENCE times for that, and only
+ * gets one superblock (its regions can still be recompiled one by one after
+ * deopting, though).
+ *
+ * @param co The code object.
+ * @param latch The BB that ends with the back edge.
+ * @param header The BB the back edge jumps to.
+*/
+static void
+jit_loop_back_edge(PyCodeObject *co, _PyTier2BBMetadata *latch,
+    _PyTier2BBMetadata *header)
+{
+    _PyTier2Info *t2_info = co->_tier2_info;
+    _PyTier2BBMetadata *first = header->jit_region;
+    // Nothing to link yet, not actually a back edge, or done already:
+    if (latch->exit_machine_code == NULL || header->tier1_end > latch->tier1_end ||
+        first->jit_loop_warmup < 0)
+    {
+        return;
+    }
+    if (first->jit_loop_bb_count != t2_info->bb_data_curr) {
+        first->jit_loop_bb_count = t2_info->bb_data_curr;
+        first->jit_loop_warmup = JIT_LOOP_WARMUP;
+    }
+    if (--first->jit_loop_patience > 0 && --first->jit_loop_warmup > 0) {
+        return;
+    }
+    first->jit_loop_warmup = -1;
+    // Failing just leaves the regions as they are, and the back edge gets
+    // linked like any other exit.
+    (void)jit_compile_loop(co, header, latch);
+}
+
+/**
+ * @brief Called by tier 2 jumps on their way to a BB. Counts down until the BB
+ * is hot, then JIT compiles it along with the rest of the BBs generated with it
+ * (see _PyTier2_Code_DetectAndEmitBB). If the jump was compiled too, also
+ * points the exit it took straight at the target's machine code. Until then,
+ * that exit bails out to the tier 2 interpreter. Loop back edges wait a bit
+ * longer (see jit_loop_back_edge).
+ *
+ * @param frame The current executing frame.
+ * @param bb_id_tagged The tagged BB ID of the BB the jump ends.
+ * @param opcode The jump the BB was compiled with (BB_BRANCH or
+ * BB_JUMP_BACKWARD_LAZY), even if it has rewritten itself since.
+ * @param successor Which exit was taken (consequent or alternative).
+ * @param target The BB the exit leads to.
+ * @return The target's machine code, or NULL to keep interpreting.
+*/
+void *
+_PyTier2_EnterBB(_PyInterpreterFrame *frame, uint16_t bb_id_tagged,
+    int opcode, int successor, _PyTier2BBMetadata *target)
+{
+    _PyTier2Info *t2_info = frame->f_code->_tier2_info;
+    assert(t2_info != NULL);
+    if (target->machine_code == NULL && target->jit_warmup >= 0 &&
+        --target->jit_warmup == 0)
+    {
+        _PyTier2BBMetadata *first = target->jit_region;
+        assert(first != NULL);
+        // Only try once, whether it works or not (unless it deopts a lot).
+        for (int i = 0; i < first->jit_region_size; i++) {
+            t2_info->bb_data[first->id + i]->jit_warmup = -1;
+        }
+        first->jit_region_deopts = 0;
+        first->jit_region_compiles++;
+        // Failing just leaves the BBs to the tier 2 interpreter.
+        (void)jit_compile(frame->f_code, first, first->jit_region_stack_depth,
+            first->jit_region_codeunits, &t2_info->bb_data[first->id],
+            first->jit_region_size);
+    }
+    if (target->machine_code != NULL) {
+        _PyTier2BBMetadata *meta = t2_info->bb_data[BB_ID(bb_id_tagged)];
+        if (opcode == BB_JUMP_BACKWARD_LAZY) {
+            jit_loop_back_edge(frame->f_code, meta, target);
+        }
+        link_jit_exit(meta, opcode, successor, target);
+    }
+    return target->machine_code;
+}
+
+/**
+ * @brief Called when machine code bails out to the tier 2 interpreter because
+ * one of its guards failed. The tier 2 code usually respecializes itself in
+ * place when that keeps happening, so once a region's machine code has
+ * bailed out JIT_DEOPT_THRESHOLD times, it is thrown away. The region then
+ * warms up again and gets compiled from what the tier 2 code looks like by
+ * then (up to JIT_MAX_COMPILES times).
+ *
+ * @param frame The current executing frame.
+ * @param instr The tier 2 instruction whose guard failed.
+*/
+void
+_PyTier2_JITDeopt(_PyInterpreterFrame *frame, _Py_CODEUNIT *instr)
+{
+    _PyTier2Info *t2_info = frame->f_code->_tier2_info;
+    assert(t2_info != NULL);
+    // Regions don't overlap, and there aren't many of them:
+    _PyTier2BBMetadata *first = NULL;
+    for (int i = 0; i < t2_info->bb_data_curr; i++) {
+        _PyTier2BBMetadata *meta = t2_info->bb_data[i];
+        if (meta->jit_region == meta && meta->tier2_start <= instr &&
+            instr < meta->tier2_start + meta->jit_region_codeunits)
+        {
+            first = meta;
+            break;
+        }
+    }
+    if (first == NULL ||
+        ++first->jit_region_deopts < JIT_DEOPT_THRESHOLD)
+    {
+        return;
+    }
+#if JIT_DEBUG
+    fprintf(stderr, "JIT: region of BB %d deopted %d times, dropping it\n",
+        first->id, first->jit_region_deopts);
+#endif
+    first->jit_region_deopts = 0;
+    relink_jit_exits_to(t2_info, first, true);
+    // The old machine code stays in the arena, but nothing leads there now:
+    bool again = first->jit_region_compiles < JIT_MAX_COMPILES;
+    for (int i = 0; i < first->jit_region_size; i++) {
+        _PyTier2BBMetadata *meta = t2_info->bb_data[first->id + i];
+        meta->machine_code = NULL;
+        meta->machine_code_size = 0;
+        meta->exit_machine_code = NULL;
+        meta->exit_machine_data = NULL;
+        meta->exit_instr = NULL;
+        meta->jit_warmup = again ? JIT_WARMUP : -1;
+    }
+}
+
 #undef TYPESTACK_PEEK
 #undef TYPESTACK_POKE
 #undef TYPELOCALS_SET
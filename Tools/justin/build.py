@@ -17,6 +17,10 @@
 TOOLS_JUSTIN_TEMPLATE = TOOLS_JUSTIN / "template.c"
 TOOLS_JUSTIN_TRAMPOLINE = TOOLS_JUSTIN / "trampoline.c"
 PYTHON_GENERATED_CASES_C_H = TOOLS_JUSTIN.parent.parent / "Python" / "generated_cases.c.h"
+PYTHON_CEVAL_MACROS_H = TOOLS_JUSTIN.parent.parent / "Python" / "ceval_macros.h"
+INCLUDE = TOOLS_JUSTIN.parent.parent / "Include"
+INCLUDE_OPCODE_H = INCLUDE / "opcode.h"
+INCLUDE_INTERNAL_PYCORE_OPCODE_H = INCLUDE / "internal" / "pycore_opcode.h"
 
 def batched(iterable, n):
     """Batch an iterable into lists of size n."""
@@ -198,8 +202,6 @@ def find_llvm_tool(tool: str) -> tuple[str, int]:
                 return path, version
     raise RuntimeError(f"Can't find {tool}!")
 
-# TODO: Divide into read-only data and writable/executable text.
-
 class ObjectParser:
 
     _ARGS = [
@@ -218,6 +220,12 @@ def __init__(self, path: pathlib.Path, reader: str, symbol_prefix: str = "") ->
         self.body = bytearray()
         self.body_symbols = {}
         self.body_offsets = {}
+        # Read-only data goes here, and is laid out apart from the code (see
+        # parse):
+        self.data = bytearray()
+        self.data_symbols = {}
+        self.data_offsets = {}
+        self.data_relocations_todo = []
         self.relocations = {}
         self.dupes = set()
         self.got_entries = []
@@ -240,27 +248,80 @@ async def parse(self):
         self._data = json.loads(output[start:end])
         for section in unwrap(self._data, "Section"):
             self._handle_section(section)
+        # Everything is located as if the data came right after the code, but
+        # it won't (see Python/jit.c). So holes that point into the data are
+        # relative to HOLE_data instead of HOLE_base:
+        code = len(self.body)
+        self.body.extend(self.data)
+        for before, relocation in self.data_relocations_todo:
+            self.relocations_todo.append((code + before, relocation))
         # if "_justin_entry" in self.body_symbols:
         #     entry = self.body_symbols["_justin_entry"]
         # else:
         #     entry = self.body_symbols["_justin_trampoline"]
         entry = 0  # XXX
         holes = []
+        calls = []
         for before, relocation in self.relocations_todo:
             for newhole in handle_one_relocation(self.got_entries, self.body, before, relocation):
                 assert newhole.symbol not in self.dupes
                 if newhole.symbol in self.body_symbols:
                     addend = newhole.addend + self.body_symbols[newhole.symbol] - entry
-                    newhole = Hole("_justin_base", newhole.offset, addend, newhole.pc)
+                    newhole = Hole("_justin_base", newhole.offset, addend, newhole.pc, newhole.size)
+                elif newhole.symbol in self.data_symbols:
+                    addend = newhole.addend + self.data_symbols[newhole.symbol]
+                    newhole = Hole("_justin_data", newhole.offset, addend, newhole.pc, newhole.size)
+                elif (
+                    _is_plt32(relocation)
+                    and not newhole.symbol.startswith("_justin_")
+                    and not _declared(newhole.symbol)
+                ):
+                    # Shared libraries can be anywhere, so calls into them
+                    # go through a stub instead (see below). Our own holes,
+                    # like the jump to HOLE_continue, are patched directly:
+                    if newhole.symbol not in self.got_entries:
+                        self.got_entries.append(newhole.symbol)
+                    calls.append(newhole)
+                    continue
                 holes.append(newhole)
+        self.body.extend([0] * (-len(self.body) % 8))
         got = len(self.body)
+        holes = [
+            Hole("_justin_data", hole.offset, hole.addend + got - code, hole.pc, hole.size)
+            if hole.symbol == "_justin_got" else hole
+            for hole in holes
+        ]
         for i, got_symbol in enumerate(self.got_entries):
             if got_symbol in self.body_symbols:
                 self.body_symbols[got_symbol] -= entry
             holes.append(Hole(got_symbol, got + 8 * i, 0, 0))
         self.body.extend([0] * 8 * len(self.got_entries))
+        # A tiny PLT after the GOT, with one "jmp *GOT[symbol](%rip)" stub
+        # for each symbol that needs one:
+        stubs = {}
+        for call in calls:
+            if call.symbol not in stubs:
+                stubs[call.symbol] = len(self.body)
+                addend = got - code + 8 * self.got_entries.index(call.symbol) - 4
+                holes.append(Hole("_justin_data", len(self.body) + 2, addend, -1, 4))
+                self.body.extend([0xFF, 0x25, 0x00, 0x00, 0x00, 0x00, 0xCC, 0xCC])
+            addend = call.addend + stubs[call.symbol] - code
+            holes.append(Hole("_justin_data", call.offset, addend, -1, 4))
         holes.sort(key=lambda hole: hole.offset)
-        return Stencil(bytes(self.body)[entry:], tuple(holes))  # XXX
+        # Most stencils end by jumping to the next one, which is usually right
+        # after them. Remember where, so the JIT can leave the jump out:
+        trailing_jump = 0
+        if 5 <= code and self.body[code - 5] == 0xE9:  # jmp rel32
+            for hole in holes:
+                if (
+                    hole.symbol == "_justin_continue"
+                    and hole.offset == code - 4
+                    and hole.pc == -1
+                    and hole.addend % (1 << 64) == -4 % (1 << 64)
+                ):
+                    trailing_jump = 5
+        body = bytes(self.body)
+        return Stencil(body[entry:code], body[code:], tuple(holes), trailing_jump)  # XXX
 
 @dataclasses.dataclass(frozen=True)
 class Hole:
@@ -268,13 +329,37 @@ class Hole:
     offset: int
     addend: int
     pc: int
+    # In bytes. Four-byte holes are signed, and usually PC-relative:
+    size: int = 8
 
 @dataclasses.dataclass(frozen=True)
 class Stencil:
     body: bytes
+    # Read-only data, the GOT, and PLT stubs. Holes past the end of the body
+    # are in here:
+    data: bytes
     holes: tuple[Hole, ...]
+    # How many bytes at the end of the body just jump to HOLE_continue:
+    trailing_jump: int
     # entry: int
 
+@functools.cache
+def _python_headers() -> str:
+    headers = [PYTHON_CEVAL_MACROS_H, *INCLUDE.glob("**/*.h")]
+    return "\n".join(header.read_text() for header in headers)
+
+def _declared(symbol: str) -> bool:
+    # Symbols that Python's own headers declare can be resolved by the
+    # linker. Anything else (like libc's assertion handler) is looked up
+    # once at runtime instead:
+    return re.search(rf"\b{re.escape(symbol)}\b", _python_headers()) is not None
+
+def _is_plt32(relocation: typing.Mapping[str, typing.Any]) -> bool:
+    match relocation:
+        case {"Type": {"Value": "R_X86_64_PLT32"}}:
+            return True
+    return False
+
 def handle_one_relocation(
     got_entries: list[str],
     body: bytearray,
@@ -307,7 +392,7 @@ def handle_one_relocation(
             body[where] = [0] * 4
             # assert symbol.startswith("_")
             symbol = symbol.removeprefix("_")
-            yield Hole(symbol, offset, addend, 0)
+            yield Hole(symbol, offset, addend, 0, 4)
         case {
             "Addend": int(addend),
             "Offset": int(offset),
@@ -338,36 +423,50 @@ def handle_one_relocation(
             "Offset": int(offset),
             "Symbol": {"Value": str(symbol)},
             "Type": {"Value": "R_X86_64_GOTOFF64"},
+        }:
+            # XXX: This is S - GOT, but the GOT isn't at a fixed distance
+            # from the code anymore. Only the large code model uses it, which
+            # Linux builds don't:
+            raise NotImplementedError(relocation)
+        case {
+            "Addend": int(addend),
+            "Offset": int(offset),
+            "Symbol": {"Value": "_GLOBAL_OFFSET_TABLE_"},
+            "Type": {"Value": "R_X86_64_GOTPC64"},
         }:
             offset += base
             where = slice(offset, offset + 8)
             what = int.from_bytes(body[where], sys.byteorder)
             assert not what, what
-            addend += offset - len(body)
-            yield Hole(symbol, offset, addend, -1)
+            yield Hole("_justin_got", offset, addend, -1)
         case {
             "Addend": int(addend),
             "Offset": int(offset),
-            "Symbol": {"Value": "_GLOBAL_OFFSET_TABLE_"},
-            "Type": {"Value": "R_X86_64_GOTPC64"},
+            "Symbol": {"Value": str(symbol)},
+            "Type": {"Value": "R_X86_64_PC32" | "R_X86_64_PLT32"},
         }:
+            # We know where Python is, so calls into it skip the PLT:
             offset += base
-            where = slice(offset, offset + 8)
+            where = slice(offset, offset + 4)
             what = int.from_bytes(body[where], sys.byteorder)
             assert not what, what
-            addend += len(body) - offset
-            body[where] = int(addend).to_bytes(8, sys.byteorder)
+            yield Hole(symbol, offset, addend, -1, 4)
         case {
             "Addend": int(addend),
             "Offset": int(offset),
             "Symbol": {"Value": str(symbol)},
-            "Type": {"Value": "R_X86_64_PC32"},
+            "Type": {"Value": "R_X86_64_GOTPCREL" | "R_X86_64_GOTPCRELX" | "R_X86_64_REX_GOTPCRELX"},
         }:
+            # Relative to the symbol's entry in our own GOT, with the rest of
+            # the stencil's data (so this always fits):
             offset += base
-            where = slice(offset, offset + 4)  # XXX: The jit can only do 8 right now...
+            where = slice(offset, offset + 4)
             what = int.from_bytes(body[where], sys.byteorder)
             assert not what, what
-            yield Hole(symbol, offset, addend, -1)
+            if symbol not in got_entries:
+                got_entries.append(symbol)
+            addend += got_entries.index(symbol) * 8
+            yield Hole("_justin_got", offset, addend, -1, 4)
         case {
             "Length": 3,
             "Offset": int(offset),
@@ -465,21 +564,38 @@ def _handle_section(self, section: ELFSection) -> None:
         flags = {flag["Name"] for flag in section["Flags"]["Flags"]}
         if type == "SHT_RELA":
             assert "SHF_INFO_LINK" in flags, flags
-            before = self.body_offsets[section["Info"]]
+            if section["Info"] in self.data_offsets:
+                before = self.data_offsets[section["Info"]]
+                todo = self.data_relocations_todo
+            else:
+                before = self.body_offsets[section["Info"]]
+                todo = self.relocations_todo
             assert not section["Symbols"]
             for relocation in unwrap(section["Relocations"], "Relocation"):
-                self.relocations_todo.append((before, relocation))
+                todo.append((before, relocation))
         elif type == "SHT_PROGBITS":
-            before = self.body_offsets[section["Index"]] = len(self.body)
             if "SHF_ALLOC" not in flags:
+                self.body_offsets[section["Index"]] = len(self.body)
                 return
-            elif flags & {"SHF_EXECINSTR", "SHF_MERGE", "SHF_WRITE"} == {"SHF_MERGE"}:
+            elif "SHF_EXECINSTR" in flags:
+                bytes, symbols = self.body, self.body_symbols
+                before = self.body_offsets[section["Index"]] = len(self.body)
+            else:
+                # Keep the code contiguous, so one stencil can run straight
+                # into the next (see trailing_jump):
+                # (Python/jit.c only aligns the data to 16 bytes, which is all
+                # SSE needs. Anything more is just for speed.)
+                alignment = min(section["AddressAlignment"], 16)
+                self.data.extend([0] * (-len(self.data) % alignment))
+                bytes, symbols = self.data, self.data_symbols
+                before = self.data_offsets[section["Index"]] = len(self.data)
+            if flags & {"SHF_EXECINSTR", "SHF_MERGE", "SHF_WRITE"} == {"SHF_MERGE"}:
                 # XXX: Merge these
                 section_data = section["SectionData"]
-                self.body.extend(section_data["Bytes"])
+                bytes.extend(section_data["Bytes"])
             else:
                 section_data = section["SectionData"]
-                self.body.extend(section_data["Bytes"])
+                bytes.extend(section_data["Bytes"])
             assert not section["Relocations"]
             for symbol in unwrap(section["Symbols"], "Symbol"):
                 offset = before + symbol["Value"]
@@ -487,7 +603,8 @@ def _handle_section(self, section: ELFSection) -> None:
                 # assert name.startswith("_")  # XXX
                 name = name.removeprefix(self.symbol_prefix)  # XXX
                 assert name not in self.body_symbols
-                self.body_symbols[name] = offset
+                assert name not in self.data_symbols
+                symbols[name] = offset
         else:
             assert type in {"SHT_LLVM_ADDRSIG", "SHT_NULL", "SHT_STRTAB", "SHT_SYMTAB"}, type
 
@@ -516,14 +633,18 @@ def _handle_section(self, section: ELFSection) -> None:
     "-fomit-frame-pointer",  # XXX
     # Disable debug info:
     "-g0",  # XXX
-    # Need this to leave room for patching our 64-bit pointers:
-    "-mcmodel=large",  # XXX
 ]
 
 if sys.platform == "darwin":
     ObjectParserDefault = functools.partial(ObjectParserMachO, symbol_prefix="_")  # XXX
+    # Need this to leave room for patching our 64-bit pointers:
+    CFLAGS += ["-mcmodel=large"]  # XXX
 elif sys.platform == "linux":
     ObjectParserDefault = ObjectParserELF
+    # Calls (and jumps to the next stencil) are 32-bit PC-relative, and
+    # everything else goes through a little GOT in each stencil's data.
+    # See mmap_near_python in Python/jit.c:
+    CFLAGS += ["-fpic", "-mcmodel=small"]
 elif sys.platform == "win32":
     assert sys.argv[1] == "--windows", sys.argv[1]
     if sys.argv[2] == "Debug|Win32":
@@ -542,6 +663,8 @@ def _handle_section(self, section: ELFSection) -> None:
         pass
     else:
         assert False, sys.argv[2]
+    # Need this to leave room for patching our 64-bit pointers:
+    CFLAGS += ["-mcmodel=large"]  # XXX
     sys.argv[1:] = sys.argv[3:]
 else:
     raise NotImplementedError(sys.platform)
@@ -607,18 +730,14 @@ class Compiler:
             "UNPACK_EX",
             "UNPACK_SEQUENCE",
 
-            # Tier 2
-            "BB_BRANCH",
-            "BB_BRANCH_IF_FLAG_UNSET",
-            "BB_JUMP_IF_FLAG_UNSET",
+            # Tier 2 (BB_BRANCH and BB_JUMP_BACKWARD_LAZY rewrite themselves
+            # into these, but their machine code has exits that get patched
+            # instead; see template.c)
             "BB_BRANCH_IF_FLAG_SET",
+            "BB_BRANCH_IF_FLAG_UNSET",
             "BB_JUMP_IF_FLAG_SET",
-            "BB_JUMP_BACKWARD_LAZY",
-            "BB_TEST_ITER",
-            "BB_TEST_ITER_LIST",
-            "BB_TEST_ITER_TUPLE",            
-            "BB_TEST_ITER_RANGE",
-
+            "BB_JUMP_IF_FLAG_UNSET",
+            "JUMP_BACKWARD_QUICK",
 
             # Tier 2 unsupported
             "SEND",
@@ -634,13 +753,156 @@ class Compiler:
             "MATCH_MAPPING",
             "MATCH_SEQUENCE",
             "MATCH_KEYS",
-            "EXTENDED_ARG",
             "WITH_EXCEPT_START",
         }
     )
 
-    def __init__(self, *, verbose: bool = False) -> None:
+    # These instructions are rewritten in place at runtime (BB_TEST_ITER when
+    # it specializes), so a stencil can't assume anything about the opcode it
+    # finds there. Each family shares one stencil that handles every form its
+    # first member can take. XXX: EXTENDED_ARG only works when it's followed by
+    # one of these (or by a tier 2 jump), since everything else has its oparg
+    # burned in at JIT time:
+    _FAMILIES = (
+        (
+            "BB_TEST_ITER",
+            "BB_TEST_ITER_LIST",
+            "BB_TEST_ITER_RANGE",
+            "BB_TEST_ITER_TUPLE",
+        ),
+        # The NOP in front of a tier 2 branch becomes an EXTENDED_ARG if its
+        # rewritten jump needs one:
+        (
+            "NOP",
+            "EXTENDED_ARG",
+        ),
+    )
+
+    # Top-of-stack cache depths to build stencils for (see _use_tos_caching):
+    _TOS_DEPTHS = range(5)
+
+    # Sequences that get one stencil for the whole thing, so the compiler can
+    # optimize across them (keeping unboxed floats in registers, for example).
+    # A profile can add more (see _load_profile). At most three long, since
+    # that's how many parts template.c has holes for:
+    _SUPERINSTRUCTIONS = (
+        ("LOAD_FAST_NO_INCREF", "LOAD_FAST_NO_INCREF", "BINARY_OP_ADD_FLOAT_UNBOXED"),
+        ("LOAD_FAST_NO_INCREF", "LOAD_FAST_NO_INCREF", "BINARY_OP_SUBTRACT_FLOAT_UNBOXED"),
+        ("LOAD_FAST_NO_INCREF", "LOAD_FAST_NO_INCREF", "BINARY_OP_MULTIPLY_FLOAT_UNBOXED"),
+        ("LOAD_FAST", "LOAD_FAST"),
+        ("LOAD_FAST", "LOAD_CONST"),
+        ("STORE_FAST", "LOAD_FAST"),
+    )
+    _MAX_SUPERINSTRUCTION_LENGTH = 3
+    # Tier 2 type guards and logical branches are a test that sets
+    # frame->bb_test, then a NOP, then the BB_BRANCH that reads it. Each of
+    # these tests also gets a stencil with the rest fused in (see _fuse_branch):
+    _BRANCH_TESTS = (
+        "BB_TEST_POP_IF_FALSE",
+        "BB_TEST_POP_IF_NONE",
+        "BB_TEST_POP_IF_NOT_NONE",
+        "BB_TEST_POP_IF_TRUE",
+        "CHECK_FLOAT",
+        "CHECK_INT",
+        "CHECK_LIST",
+    )
+    # How many of a profile's hottest pairs to add:
+    _PROFILE_PAIRS = 16
+
+    # Reads of an instruction's inline cache entries (see _bake_caches):
+    _CACHE_READS = re.compile(r"\bread_(u16|u32|u64|obj)\(&next_instr\[(\d+)\]\.cache\)")
+    # The last entry a read can start at:
+    _MAX_CACHE_WORD = 5
+    # Loads of an instruction's constant (see _bake_consts):
+    _CONST_LOADS = re.compile(r"\bGETITEM\(frame->f_code->co_consts, oparg\)")
+
+    # Anything in an instruction that can leave next_instr somewhere other than
+    # the instruction after it when it dispatches:
+    _JUMPS = re.compile(
+        r"\b(?:JUMPBY|JUMPTO|DISPATCH_INLINED|DISPATCH_SAME_OPARG|GO_TO_INSTRUCTION|GO_TO_TRACE|SET_LOCALS_FROM_FRAME)\("
+        r"|\bnext_instr(?: =|--|\+\+| -=)|\bframe = |\bgoto (?:start|resume)_frame\b"
+    )
+
+    # Anything that reads or moves the stack pointer (see _uses_stack):
+    _STACK_USES = re.compile(
+        r"\bstack_pointer\b|\b(?:STACK_GROW|STACK_SHRINK|STACK_LEVEL|PEEK|POKE)\(|\bpop_\d_error\b"
+    )
+
+    # Everything an instruction can call without anything else (a finalizer,
+    # a signal handler, a tracing function...) getting the chance to look at
+    # frame->prev_instr. Most of these are macros:
+    _FRAME_SAFE_CALLS = frozenset(
+        {
+            "BB_TEST",
+            "BB_TEST_IS_SUCCESSOR",
+            "BUILTINS",
+            "CHECK_EVAL_BREAKER",  # handle_eval_breaker syncs the frame first.
+            "DECREF_INPUTS_AND_REUSE_FLOAT",
+            "DEOPT_IF",
+            "DISPATCH",
+            "DK_IS_UNICODE",
+            "DK_UNICODE_ENTRIES",
+            "ERROR_IF",
+            "GETITEM",
+            "GETLOCAL",
+            "GLOBALS",
+            "PEEK",
+            "POKE",
+            "PREDICT",
+            "PREDICTED",
+            "PyDict_CheckExact",
+            "PyFloat_CheckExact",
+            "PyFloat_FromDouble",  # Floats aren't tracked by the GC.
+            "PyList_CheckExact",
+            "PyList_GET_ITEM",
+            "PyList_GET_SIZE",
+            "PyLong_CheckExact",
+            "PyTuple_CheckExact",
+            "PyTuple_GET_ITEM",
+            "PyTuple_GET_SIZE",
+            "PyUnicode_CheckExact",
+            "Py_INCREF",
+            "Py_IS_TYPE",
+            "Py_IsFalse",
+            "Py_IsNone",
+            "Py_IsTrue",
+            "Py_NewRef",
+            "Py_TYPE",
+            "STACK_GROW",
+            "STACK_SHRINK",
+            "STAT_INC",
+            "TARGET",
+            "_PyLong_IsNonNegativeCompact",
+            "_Py_DECREF_NO_DEALLOC",
+            "_Py_DECREF_SPECIALIZED",  # Only for exact floats, ints, and strs.
+            "assert",
+            "read_obj",
+            "read_u16",
+            "read_u32",
+            "read_u64",
+            "static_assert",
+        }
+    )
+
+    def __init__(
+        self,
+        *,
+        verbose: bool = False,
+        profile: str | None = None,
+        static_stack: bool = False,
+    ) -> None:
         self._stencils_built = {}
+        # opname (or superinstruction name) -> the stencil to use at each of
+        # _TOS_DEPTHS:
+        self._variants = {}
+        # Same, but without the checks at the start (see _add_variants):
+        self._interior_variants = {}
+        # superinstruction name -> the opnames it's made of:
+        self._superinstructions = {}
+        self._profile = profile
+        self._static_stack = static_stack
+        # Don't start hundreds of compilers at once:
+        self._semaphore = asyncio.Semaphore(os.cpu_count() or 1)
         self._verbose = verbose
         self._clang, clang_version = find_llvm_tool("clang")
         self._readobj, readobj_version = find_llvm_tool("llvm-readobj")
@@ -656,45 +918,247 @@ def _use_ghccc(ll: pathlib.Path, enable: bool = False) -> None:
             ir = ll.read_text()
             ir = ir.replace("i32 @_justin_continue", "ghccc i32 @_justin_continue")
             ir = ir.replace("i32 @_justin_entry", "ghccc i32 @_justin_entry")
+            # Jumps to other BBs (GO_TO_TRACE):
+            ir = re.sub(r"musttail call i32 (%[\w.]+)\(", r"musttail call ghccc i32 \1(", ir)
+            if "@_justin_trampoline(" in ir:
+                ir = re.sub(r"call i32 (%[\w.]+)\(", r"call ghccc i32 \1(", ir)
             ll.write_text(ir)
 
     @staticmethod
-    def _use_tos_caching(c: pathlib.Path, enable: int = 0) -> None:
+    def _use_tos_caching(c: pathlib.Path, depth: int = 0) -> None:
+        # Every stencil hands the top four stack items to the next one in
+        # _tos1.._tos4, so they all share one calling convention. A stencil
+        # built for a given depth reads that many of them instead of going
+        # through stack_pointer (and only assumes anything about those):
         sc = c.read_text()
-        for i in range(1, enable + 1):
+        for i in range(1, depth + 1):
             sc = sc.replace(f" = stack_pointer[-{i}];", f" = _tos{i};")
-        for i in range(enable + 1, 5):
+        # The top two are passed along as doubles in _ftos1 and _ftos2 as well,
+        # which end up in floating point registers. Instructions that use them
+        # as unboxed floats read those instead, so a run of float stencils
+        # never has to move them between register files:
+        for i in range(1, min(depth, 2) + 1):
+            for name in re.findall(rf"\bPyObject \*(\w+) = _tos{i};", sc):
+                sc = sc.replace(f"*(double *)(&({name}))", f"_ftos{i}")
+        for i in range(depth + 1, 5):
             sc = "".join(
-                line for line in sc.splitlines(True) if f"_tos{i}" not in line
+                line for line in sc.splitlines(True)
+                if f"__builtin_assume(_tos{i} " not in line
             )
         c.write_text(sc)
 
-    async def _compile(self, opname, body) -> None:
-        defines = [f"-D_JUSTIN_OPCODE={opname}"]
-        with tempfile.TemporaryDirectory() as tempdir:
-            c = pathlib.Path(tempdir, f"{opname}.c")
-            ll = pathlib.Path(tempdir, f"{opname}.ll")
-            o = pathlib.Path(tempdir, f"{opname}.o")
-            c.write_text(body)
-            self._use_tos_caching(c, 0)
-            self._stderr(f"Compiling {opname}...")
-            process = await asyncio.create_subprocess_exec(self._clang, *CFLAGS, "-emit-llvm", "-S", *defines, "-o", ll, c)
-            stdout, stderr = await process.communicate()
-            assert stdout is None, stdout
-            assert stderr is None, stderr
-            if process.returncode:
-                raise RuntimeError(f"{self._clang} exited with {process.returncode}")
-            self._use_ghccc(ll, True)
-            self._stderr(f"Recompiling {opname}...")
-            process = await asyncio.create_subprocess_exec(self._clang, *CFLAGS, "-c", "-o", o, ll)
-            stdout, stderr = await process.communicate()
-            assert stdout is None, stdout
-            assert stderr is None, stderr
-            if process.returncode:
-                raise RuntimeError(f"{self._clang} exited with {process.returncode}")
-            self._stderr(f"Parsing {opname}...")
-            self._stencils_built[opname] = await ObjectParserDefault(o, self._readobj).parse()
-        self._stderr(f"Built {opname}!")
+    def _add_variants(
+        self,
+        opname: str,
+        case: str,
+        family: bool = False,
+        name: str | None = None,
+        interior: bool = False,
+    ) -> list:
+        # Deeper variants only differ if the instruction actually reads that
+        # far down the stack. Otherwise, they're the same as the one above.
+        # Interior variants are for instructions that can only be reached by
+        # falling through from the one before them in the same trace, so they
+        # can skip most of the checks at the start of the template:
+        name = name or opname
+        tasks = []
+        variants = []
+        for depth in self._TOS_DEPTHS:
+            if depth and f" = stack_pointer[-{depth}];" not in case:
+                variants.append(variants[-1])
+                continue
+            variant = f"{name}_interior_{depth}" if interior else f"{name}_{depth}"
+            body = self._template % "\n".join([self._baked_externs, self._uop_macros, case])
+            lazy = interior and not self._observes_frame(case)
+            static_stack = self._static_stack and self._uses_stack(case)
+            tasks.append(
+                self._compile(variant, opname, body, depth, family, interior, lazy, static_stack)
+            )
+            variants.append(variant)
+        if interior:
+            self._interior_variants[name] = variants
+        else:
+            self._variants[name] = variants
+        return tasks
+
+    def _falls_through(self, opname: str) -> bool:
+        # Whether the instruction after this one can use an interior stencil:
+        for family in self._FAMILIES:
+            if opname in family:
+                return not any(self._JUMPS.search(self._cases[member]) for member in family)
+        return not self._JUMPS.search(self._cases[opname])
+
+    def _observes_frame(self, case: str) -> bool:
+        # Whether anything in this instruction (or superinstruction, or family)
+        # might need frame->prev_instr to be up to date:
+        if "frame->prev_instr" in case:
+            return True
+        return not set(re.findall(r"\b(\w+)\(", case)) <= self._FRAME_SAFE_CALLS
+
+    def _uses_stack(self, case: str) -> bool:
+        # Whether the instruction finds the top of the stack from the frame
+        # (see template.c). The ones that never touch it just pass it along,
+        # which is also what keeps the NOP and BB_BRANCH after a BB_TEST_ITER
+        # right: they run at whatever depth it left, and an exhausted iterator
+        # leaves a different one:
+        return bool(self._STACK_USES.search(case))
+
+    def _bake_caches(self, case: str, part: int = 0) -> str:
+        # Tier 2 code is specialized for the types it has seen, so whatever the
+        # instruction reads from its inline cache (type versions, indices,
+        # borrowed references...) is patched into the code when it's compiled.
+        # These all come from one specialization and are checked by its guards
+        # before being used, so a stale copy just deopts (see _PyTier2_JITDeopt).
+        # The adaptive counter in the first entry changes as the code runs,
+        # though. Like opargs, the values are patched in plus one, since the
+        # compiler may assume that the address of a symbol isn't zero:
+        suffix = f"_{part}" if part else ""
+        def bake(match: re.Match[str]) -> str:
+            kind, word = match.group(1), int(match.group(2))
+            if not word:
+                return match.group()
+            assert word <= self._MAX_CACHE_WORD, match.group()
+            value = f"((uintptr_t)&_justin_cache_{word}_plus_one{suffix} - 1)"
+            if kind == "obj":
+                return f"((PyObject *){value})"
+            return f"((uint{kind[1:]}_t){value})"
+        return self._CACHE_READS.sub(bake, case)
+
+    def _bake_consts(self, case: str, part: int = 0) -> str:
+        # Code objects own their machine code, and co_consts never changes, so
+        # the constant an instruction loads is patched into the code as a
+        # pointer. Only when oparg is still this instruction's own, though
+        # (tier one superinstructions load the next one's as they go):
+        if re.search(r"\boparg = ", case):
+            return case
+        suffix = f"_{part}" if part else ""
+        return self._CONST_LOADS.sub(f"((PyObject *)&_justin_const{suffix})", case)
+
+    def _rewritten_in_place(self, opname: str) -> bool:
+        # Specializing (and despecializing) instructions changes their opcode,
+        # but keeps them in the same family in _PyOpcode_Deopt:
+        return opname in self._rewritable
+
+    def _fuse(self, opnames: tuple[str, ...]) -> str:
+        # Each part dispatches straight to the next one. The parts after the
+        # first need the same checks as an interior stencil's entry, and can't
+        # read the stack through _tos1.._tos4 (it's moved since then):
+        lines = []
+        for i, opname in enumerate(opnames):
+            case = self._bake_consts(self._bake_caches(self._cases[opname], i), i)
+            if i:
+                lines.append(f"_justin_part_{i}:")
+                if not self._falls_through(opnames[i - 1]):
+                    lines.append(f"    if (next_instr != &_justin_next_instr_{i}) {{")
+                    lines.append(f"        goto _return_ok;")
+                    lines.append(f"    }}")
+                if self._rewritten_in_place(opname):
+                    lines.append(f"    if (next_instr->op.code != {opname}) {{")
+                    lines.append(f"        _justin_prev_instr = next_instr;")
+                    lines.append(f"        goto _return_deopt;")
+                    lines.append(f"    }}")
+                lines.append(f"    opcode = {opname};")
+                lines.append(f"    oparg = (uintptr_t)&_justin_oparg_plus_one_{i} - 1;")
+                case = case.replace("stack_pointer[-", "stack_pointer[/* DON'T REPLACE ME */ -")
+            target = f"_justin_part_{i + 1}" if i + 1 < len(opnames) else "_continue"
+            lines.append(f"#undef DISPATCH_GOTO")
+            lines.append(f"#define DISPATCH_GOTO() \\")
+            lines.append(f"    do {{                \\")
+            lines.append(f"        goto {target}; \\")
+            lines.append(f"    }} while (0)")
+            lines.append(case)
+        return "\n".join(lines)
+
+    def _fuse_branch(self, opname: str) -> str:
+        # The test dispatches straight to the branch's exits, which the
+        # compiler can pick between on whatever the test found without reading
+        # the flag back. The NOP in between has nothing to do (not even if it's
+        # an EXTENDED_ARG by now, since the exits are patched in). The flag is
+        # still set, for the interpreter to read when an exit is a stub:
+        case = self._bake_consts(self._bake_caches(self._cases[opname]))
+        lines = []
+        lines.append(f"#undef DISPATCH_GOTO")
+        lines.append(f"#define DISPATCH_GOTO() \\")
+        lines.append(f"    do {{                \\")
+        lines.append(f"        _JUSTIN_BB_BRANCH(); \\")
+        lines.append(f"    }} while (0)")
+        lines.append(case)
+        return "\n".join(lines)
+
+    def _load_profile(self, path: str) -> list[tuple[str, ...]]:
+        # Either the JSON written by Tools/scripts/summarize_stats.py's
+        # --json-output, or a directory of raw pystats files:
+        profile = pathlib.Path(path)
+        stats = {}
+        if profile.is_dir():
+            for file in profile.iterdir():
+                for line in file.read_text().splitlines():
+                    key, _, value = line.partition(":")
+                    if value.strip().isdigit():
+                        stats[key.strip()] = stats.get(key.strip(), 0) + int(value)
+        else:
+            stats = json.loads(profile.read_text())
+        opnames = {}
+        for opname, opcode in re.findall(r"#define (\w+) +(\d+)", INCLUDE_OPCODE_H.read_text()):
+            if opname in self._cases:
+                opnames[int(opcode)] = opname
+        pairs = []
+        for key, count in stats.items():
+            match = re.fullmatch(r"opcode\[(\d+)\]\.pair_count\[(\d+)\]", key)
+            if match:
+                first, second = (opnames.get(int(opcode)) for opcode in match.groups())
+                if first in self._fusable and second in self._fusable:
+                    pairs.append((count, (first, second)))
+        pairs.sort(reverse=True)
+        return [pair for _, pair in pairs[:self._PROFILE_PAIRS]]
+
+    async def _compile(
+        self,
+        name,
+        opname,
+        body,
+        depth: int = 0,
+        family: bool = False,
+        interior: bool = False,
+        lazy: bool = False,
+        static_stack: bool = False,
+    ) -> None:
+        async with self._semaphore:
+            defines = [f"-D_JUSTIN_OPCODE={opname}"]
+            if family:
+                defines.append("-D_JUSTIN_FAMILY")
+            if interior:
+                defines.append("-D_JUSTIN_INTERIOR")
+                if self._rewritten_in_place(opname):
+                    defines.append("-D_JUSTIN_REWRITTEN_IN_PLACE")
+            if lazy:
+                defines.append("-D_JUSTIN_LAZY_PREV_INSTR")
+            if static_stack:
+                defines.append("-D_JUSTIN_STATIC_STACK")
+            with tempfile.TemporaryDirectory() as tempdir:
+                c = pathlib.Path(tempdir, f"{name}.c")
+                ll = pathlib.Path(tempdir, f"{name}.ll")
+                o = pathlib.Path(tempdir, f"{name}.o")
+                c.write_text(body)
+                self._use_tos_caching(c, depth)
+                self._stderr(f"Compiling {name}...")
+                process = await asyncio.create_subprocess_exec(self._clang, *CFLAGS, "-emit-llvm", "-S", *defines, "-o", ll, c)
+                stdout, stderr = await process.communicate()
+                assert stdout is None, stdout
+                assert stderr is None, stderr
+                if process.returncode:
+                    raise RuntimeError(f"{self._clang} exited with {process.returncode}")
+                self._use_ghccc(ll, True)
+                self._stderr(f"Recompiling {name}...")
+                process = await asyncio.create_subprocess_exec(self._clang, *CFLAGS, "-c", "-o", o, ll)
+                stdout, stderr = await process.communicate()
+                assert stdout is None, stdout
+                assert stderr is None, stderr
+                if process.returncode:
+                    raise RuntimeError(f"{self._clang} exited with {process.returncode}")
+                self._stderr(f"Parsing {name}...")
+                self._stencils_built[name] = await ObjectParserDefault(o, self._readobj).parse()
+            self._stderr(f"Built {name}!")
 
     async def build(self) -> None:
         generated_cases = PYTHON_GENERATED_CASES_C_H.read_text()
@@ -703,25 +1167,116 @@ async def build(self) -> None:
         self._cases = {}
         for body, opname in re.findall(pattern, generated_cases):
             self._cases[opname] = body.replace(" " * 8, " " * 4)
-        uop_macros = "\n".join(re.findall(uop_pattern, generated_cases))
-        template = TOOLS_JUSTIN_TEMPLATE.read_text()
+        self._uop_macros = "\n".join(re.findall(uop_pattern, generated_cases))
+        self._baked_externs = "\n".join(
+            [
+                f"    extern void _justin_cache_{word}_plus_one{suffix};"
+                for word in range(1, self._MAX_CACHE_WORD + 1)
+                for suffix in ("", "_1", "_2")
+            ]
+            + [f"    extern void _justin_const{suffix};" for suffix in ("", "_1", "_2")]
+        )
+        self._template = TOOLS_JUSTIN_TEMPLATE.read_text()
+        deopt = re.findall(r"\[(\w+)\] = (\w+),", INCLUDE_INTERNAL_PYCORE_OPCODE_H.read_text())
+        self._rewritable = {
+            opname
+            for specialized, generic in deopt
+            if specialized != generic
+            for opname in (specialized, generic)
+        }
         tasks = []
-        for opname in sorted(self._cases.keys() - self._SKIP):
-            body = template % "\n".join([uop_macros, self._cases[opname]])
-            tasks.append(self._compile(opname, body))
+        members = {opname for family in self._FAMILIES for opname in family}
+        # Tier 2 jumps (and the end of the trace) have special stencils:
+        self._fusable = (
+            self._cases.keys() - self._SKIP - members
+            - {"BB_BRANCH", "BB_JUMP_BACKWARD_LAZY", "EXIT_TRACE"}
+        )
+        for opname in sorted(self._cases.keys() - self._SKIP - members):
+            # Family stencils switch on whatever the opcode is at run time, so
+            # they read their caches and constants at run time too:
+            case = self._bake_consts(self._bake_caches(self._cases[opname]))
+            tasks.extend(self._add_variants(opname, case))
+            if opname in self._fusable:
+                tasks.extend(self._add_variants(opname, case, interior=True))
+        for family in self._FAMILIES:
+            tasks.extend(self._add_variants(family[0], self._dispatch(family), family=True))
+            tasks.extend(self._add_variants(family[0], self._dispatch(family), family=True, interior=True))
+        sequences = list(self._SUPERINSTRUCTIONS)
+        if self._profile:
+            sequences.extend(self._load_profile(self._profile))
+        for opnames in dict.fromkeys(sequences):
+            assert 1 < len(opnames) <= self._MAX_SUPERINSTRUCTION_LENGTH, opnames
+            if not set(opnames) <= self._fusable:
+                continue
+            name = "__".join(opnames)
+            self._superinstructions[name] = opnames
+            tasks.extend(self._add_variants(opnames[0], self._fuse(opnames), name=name))
+            tasks.extend(self._add_variants(opnames[0], self._fuse(opnames), name=name, interior=True))
+        # Fused branches end with a jump, so (like the jumps themselves) they
+        # have no interior variants:
+        for opname in self._BRANCH_TESTS:
+            assert opname in self._fusable, opname
+            opnames = (opname, "NOP", "BB_BRANCH")
+            name = "__".join(opnames)
+            self._superinstructions[name] = opnames
+            tasks.extend(self._add_variants(opname, self._fuse_branch(opname), name=name))
         opname = "trampoline"
         body = TOOLS_JUSTIN_TRAMPOLINE.read_text()
-        tasks.append(self._compile(opname, body))
+        tasks.append(self._compile(opname, opname, body))
         await asyncio.gather(*tasks)
 
+    def _dispatch(self, family: tuple[str, ...]) -> str:
+        lines = []
+        lines.append(f"    // The oparg may have been rewritten, too:")
+        lines.append(f"    oparg = next_instr->op.arg;")
+        lines.append(f"    if (next_instr[-1].op.code == EXTENDED_ARG) {{")
+        lines.append(f"        oparg |= next_instr[-1].op.arg << 8;")
+        lines.append(f"    }}")
+        lines.append(f"    switch (next_instr->op.code) {{")
+        for opname in family:
+            lines.append(f"    case {opname}:")
+            lines.append(self._cases[opname])
+        lines.append(f"    default:")
+        lines.append(f"        goto _return_ok;")
+        lines.append(f"    }}")
+        return "\n".join(lines)
+
     def dump(self) -> str:
         lines = []
+        symbols = sorted(
+            {
+                hole.symbol
+                for stencil in self._stencils_built.values()
+                for hole in stencil.holes
+                if not hole.symbol.startswith("_justin_")
+            }
+        )
+        indices = {symbol: i for i, symbol in enumerate(symbols)}
+        declared = set(filter(_declared, symbols))
         kinds = {
+            "HOLE_alternative",
+            "HOLE_alternative_instr",
             "HOLE_base",
+            "HOLE_consequent",
+            "HOLE_consequent_instr",
+            "HOLE_const",
+            "HOLE_const_1",
+            "HOLE_const_2",
             "HOLE_continue",
+            "HOLE_data",
             "HOLE_next_instr",
+            "HOLE_next_instr_1",
+            "HOLE_next_instr_2",
             "HOLE_next_trace",
             "HOLE_oparg_plus_one",
+            "HOLE_oparg_plus_one_1",
+            "HOLE_oparg_plus_one_2",
+            "HOLE_stack_level_plus_one",
+            *(
+                f"HOLE_cache_{word}_plus_one{suffix}"
+                for word in range(1, self._MAX_CACHE_WORD + 1)
+                for suffix in ("", "_1", "_2")
+            ),
         }
         opnames = []
         for opname, stencil in sorted(self._stencils_built.items()):
@@ -732,30 +1287,54 @@ def dump(self) -> str:
             for chunk in batched(stencil.body, 8):
                 lines.append(f"    {', '.join(f'0x{byte:02X}' for byte in chunk)},")
             lines.append(f"}};")
+            lines.append(f"static unsigned char {opname}_stencil_data[] = {{")
+            for chunk in batched(stencil.data, 8):
+                lines.append(f"    {', '.join(f'0x{byte:02X}' for byte in chunk)},")
+            lines.append(f"    0x00,  // Padding, since C doesn't allow empty arrays.")
+            lines.append(f"}};")
+            lines.append(f"#define {opname}_stencil_trailing_jump {stencil.trailing_jump}")
             holes = []
             loads = []
             for hole in stencil.holes:
                 if hole.symbol.startswith("_justin_"):
                     kind = f"HOLE_{hole.symbol.removeprefix('_justin_')}"
                     assert kind in kinds, kind
-                    holes.append(f"    {{.offset = {hole.offset:4}, .addend = {hole.addend:4}, .kind = {kind}, .pc = {hole.pc}}},")
+                    holes.append(f"    {{.offset = {hole.offset:4}, .addend = {hole.addend:4}, .kind = {kind}, .pc = {hole.pc:2}, .size = {hole.size}}},")
                 else:
-                    loads.append(f"    {{.offset = {hole.offset:4}, .addend = {hole.addend:4}, .symbol = \"{hole.symbol}\", .pc = {hole.pc}}},")
-            assert holes, stencil.holes
+                    loads.append(f"    {{.offset = {hole.offset:4}, .addend = {hole.addend:4}, .symbol = {indices[hole.symbol]:3}, .pc = {hole.pc:2}, .size = {hole.size}}},  // {hole.symbol}")
             lines.append(f"static const Hole {opname}_stencil_holes[] = {{")
             for hole in holes:
                 lines.append(hole)
+            lines.append(f"    {{.offset =    0, .addend =    0, .kind = HOLE_base, .pc =  0, .size = 8}},")
             lines.append(f"}};")
             lines.append(f"static const SymbolLoad {opname}_stencil_loads[] = {{")
             for  load in loads:
                 lines.append(load)
-            lines.append(f"    {{.offset =    0, .addend =    0, .symbol = NULL, .pc = 0}},")
+            lines.append(f"    {{.offset =    0, .addend =    0, .symbol =   0, .pc =  0, .size = 8}},")
             lines.append(f"}};")
             lines.append(f"")
+        lines.append(f"static const char * const symbol_names[] = {{")
+        for symbol in symbols:
+            lines.append(f"    \"{symbol}\",")
+        lines.append(f"}};")
+        lines.append(f"")
+        lines.append(f"// Zero for anything the linker can't fill in:")
+        lines.append(f"static uintptr_t symbol_addresses[] = {{")
+        for symbol in symbols:
+            if symbol in declared:
+                lines.append(f"    (uintptr_t)&{symbol},")
+            else:
+                lines.append(f"    0,  // {symbol}")
+        lines.append(f"}};")
+        lines.append(f"")
         lines.append(f"#define INIT_STENCIL(OP) {{                             \\")
+        lines.append(f"    .name = #OP,                                       \\")
         lines.append(f"    .nbytes = Py_ARRAY_LENGTH(OP##_stencil_bytes),     \\")
         lines.append(f"    .bytes = OP##_stencil_bytes,                       \\")
-        lines.append(f"    .nholes = Py_ARRAY_LENGTH(OP##_stencil_holes),     \\")
+        lines.append(f"    .ndata = Py_ARRAY_LENGTH(OP##_stencil_data) - 1,   \\")
+        lines.append(f"    .data = OP##_stencil_data,                         \\")
+        lines.append(f"    .trailing_jump = OP##_stencil_trailing_jump,       \\")
+        lines.append(f"    .nholes = Py_ARRAY_LENGTH(OP##_stencil_holes) - 1, \\")
         lines.append(f"    .holes = OP##_stencil_holes,                       \\")
         lines.append(f"    .nloads = Py_ARRAY_LENGTH(OP##_stencil_loads) - 1, \\")
         lines.append(f"    .loads = OP##_stencil_loads,                       \\")
@@ -763,10 +1342,54 @@ def dump(self) -> str:
         lines.append(f"")
         lines.append(f"static const Stencil trampoline_stencil = INIT_STENCIL(trampoline);")
         lines.append(f"")
-        lines.append(f"static const Stencil stencils[256] = {{")
         assert opnames[-1] == "trampoline"
-        for opname in opnames[:-1]:
-            lines.append(f"    [{opname}] = INIT_STENCIL({opname}),")
+        aliases = {opname: family[0] for family in self._FAMILIES for opname in family}
+        table = sorted(self._variants.keys() - self._superinstructions.keys() | aliases.keys())
+        lines.append(f"static const Stencil stencils[256][MAX_TOS_DEPTH + 1] = {{")
+        for opname in table:
+            variants = self._variants[aliases.get(opname, opname)]
+            lines.append(f"    [{opname}] = {{")
+            for variant in variants:
+                lines.append(f"        INIT_STENCIL({variant}),")
+            lines.append(f"    }},")
+        lines.append(f"}};")
+        lines.append(f"")
+        lines.append(f"// Jumps and EXIT_TRACE always check:")
+        lines.append(f"static const Stencil interior_stencils[256][MAX_TOS_DEPTH + 1] = {{")
+        for opname in table:
+            name = aliases.get(opname, opname)
+            variants = self._interior_variants.get(name, self._variants[name])
+            lines.append(f"    [{opname}] = {{")
+            for variant in variants:
+                lines.append(f"        INIT_STENCIL({variant}),")
+            lines.append(f"    }},")
+        lines.append(f"}};")
+        lines.append(f"")
+        lines.append(f"// Whether the instruction after each one can use an interior stencil:")
+        lines.append(f"static const bool falls_through[256] = {{")
+        for opname in table:
+            if self._falls_through(opname):
+                lines.append(f"    [{opname}] = true,")
+        lines.append(f"}};")
+        lines.append(f"")
+        lines.append(f"// Longest first:")
+        lines.append(f"static const Superinstruction superinstructions[] = {{")
+        for name, sequence in sorted(
+            self._superinstructions.items(), key=lambda item: (-len(item[1]), item[0])
+        ):
+            lines.append(f"    {{")
+            lines.append(f"        .length = {len(sequence)},")
+            lines.append(f"        .opcodes = {{{', '.join(sequence)}}},")
+            lines.append(f"        .stencils = {{")
+            for variant in self._variants[name]:
+                lines.append(f"            INIT_STENCIL({variant}),")
+            lines.append(f"        }},")
+            lines.append(f"        .interior_stencils = {{")
+            for variant in self._interior_variants.get(name, self._variants[name]):
+                lines.append(f"            INIT_STENCIL({variant}),")
+            lines.append(f"        }},")
+            lines.append(f"    }},")
+        lines.append(f"    {{.length = 0}},")
         lines.append(f"}};")
         lines.append(f"")
         lines.append(f"#define INIT_HOLE(NAME) [HOLE_##NAME] = (uintptr_t)0xBAD0BAD0BAD0BAD0")
@@ -790,31 +1413,62 @@ def dump(self) -> str:
         header.append(f"    const uintptr_t addend;")
         header.append(f"    const HoleKind kind;")
         header.append(f"    const int pc;")
+        header.append(f"    const int size;")
         header.append(f"}} Hole;")
         header.append(f"")
         header.append(f"typedef struct {{")
         header.append(f"    const uintptr_t offset;")
         header.append(f"    const uintptr_t addend;")
-        header.append(f"    const char * const symbol;")
+        header.append(f"    const int symbol;")
         header.append(f"    const int pc;")
+        header.append(f"    const int size;")
         header.append(f"}} SymbolLoad;")
         header.append(f"")
         header.append(f"typedef struct {{")
+        header.append(f"    const char * const name;")
         header.append(f"    const size_t nbytes;")
         header.append(f"    unsigned char * const bytes;")
+        header.append(f"    const size_t ndata;")
+        header.append(f"    unsigned char * const data;")
+        header.append(f"    const size_t trailing_jump;")
         header.append(f"    const size_t nholes;")
         header.append(f"    const Hole * const holes;")
         header.append(f"    size_t nloads;")
         header.append(f"    const SymbolLoad * const loads;")
         header.append(f"}} Stencil;")
         header.append(f"")
+        header.append(f"#define MAX_TOS_DEPTH {self._TOS_DEPTHS[-1]}")
+        header.append(f"#define STATIC_STACK {int(self._static_stack)}")
+        header.append(f"#define MAX_SUPERINSTRUCTION_LENGTH {self._MAX_SUPERINSTRUCTION_LENGTH}")
+        header.append(f"")
+        header.append(f"typedef struct {{")
+        header.append(f"    const int length;")
+        header.append(f"    const int opcodes[MAX_SUPERINSTRUCTION_LENGTH];")
+        header.append(f"    const Stencil stencils[MAX_TOS_DEPTH + 1];")
+        header.append(f"    const Stencil interior_stencils[MAX_TOS_DEPTH + 1];")
+        header.append(f"}} Superinstruction;")
+        header.append(f"")
         lines[:0] = header
         lines.append("")
         return "\n".join(lines)
 
 if __name__ == "__main__":
+    # --profile PATH adds superinstructions for the hottest pairs in it (see
+    # Compiler._load_profile). It can go anywhere after --windows CONFIG:
+    profile = None
+    if "--profile" in sys.argv:
+        i = sys.argv.index("--profile")
+        profile = sys.argv[i + 1]
+        del sys.argv[i : i + 2]
+    # --static-stack has stencils find the top of the stack from the frame
+    # (see template.c). Off by default, since with -mcmodel=large every stack
+    # level is a 64-bit immediate, and that's slower than just passing
+    # stack_pointer along in a register:
+    static_stack = "--static-stack" in sys.argv
+    if static_stack:
+        sys.argv.remove("--static-stack")
     # First, create our JIT engine:
-    engine = Compiler(verbose=True)
+    engine = Compiler(verbose=True, profile=profile, static_stack=static_stack)
     # This performs all of the steps that normally happen at build time:
     # TODO: Actual arg parser...
     asyncio.run(engine.build())
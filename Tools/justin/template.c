@@ -32,8 +32,23 @@
     } while (0)
 #undef PREDICT
 #define PREDICT(OP)
+#undef GO_TO_TRACE
+#define GO_TO_TRACE(TRACE)        \
+    do {                          \
+        _justin_target = (TRACE); \
+        goto _jump;               \
+    } while (0)
 #undef TARGET
 #define TARGET(OP) INSTRUCTION_START((OP));
+#undef INSTRUCTION_START
+#ifdef _JUSTIN_LAZY_PREV_INSTR
+// Nothing this instruction calls can look at the frame, so frame->prev_instr
+// only has to be right once we leave (at _return_deopt, handle_eval_breaker,
+// or any of the other exits, which set it themselves):
+#define INSTRUCTION_START(OP) (_justin_prev_instr = next_instr++)
+#else
+#define INSTRUCTION_START(OP) (frame->prev_instr = _justin_prev_instr = next_instr++)
+#endif
 
 // XXX: Turn off trace recording in here?
 
@@ -46,13 +61,55 @@ extern _PyJITReturnCode _justin_continue(PyThreadState *tstate,
                                          , PyObject *_tos2
                                          , PyObject *_tos3
                                          , PyObject *_tos4
+                                         , double _ftos1
+                                         , double _ftos2
                                          );
 extern _Py_CODEUNIT _justin_next_instr;
 extern void _justin_oparg_plus_one;
+// How far into frame->localsplus the top of the stack is (plus one):
+extern void _justin_stack_level_plus_one;
+// The other parts of a superinstruction:
+extern _Py_CODEUNIT _justin_next_instr_1;
+extern void _justin_oparg_plus_one_1;
+extern _Py_CODEUNIT _justin_next_instr_2;
+extern void _justin_oparg_plus_one_2;
+// Exits for BB_BRANCH and BB_JUMP_BACKWARD_LAZY (these get patched again at
+// runtime):
+extern void _justin_consequent;
+extern _Py_CODEUNIT _justin_consequent_instr;
+extern void _justin_alternative;
+extern _Py_CODEUNIT _justin_alternative_instr;
 
 // XXX
 #define cframe (*tstate->cframe)
 
+// Takes whichever exit the test before the branch picked. Tests fused with
+// their branch get here straight from setting the flag, so it's never actually
+// read back (see _fuse_branch in Tools/justin/build.py):
+#define _JUSTIN_BB_BRANCH()                          \
+    do {                                             \
+        if (BB_TEST_IS_SUCCESSOR(frame)) {           \
+            next_instr = &_justin_consequent_instr;  \
+            _justin_target = &_justin_consequent;    \
+        }                                            \
+        else {                                       \
+            next_instr = &_justin_alternative_instr; \
+            _justin_target = &_justin_alternative;   \
+        }                                            \
+        goto _jump;                                  \
+    } while (0)
+
+// Unboxed floats live bit-for-bit in PyObject * stack slots. The top two slots
+// are also passed along as doubles, so floating point code can keep them in
+// floating point registers (see _use_tos_caching in Tools/justin/build.py):
+static inline double
+_justin_as_double(PyObject *o)
+{
+    double d;
+    memcpy(&d, &o, sizeof(d));
+    return d;
+}
+
 _PyJITReturnCode
 _justin_entry(PyThreadState *tstate, _PyInterpreterFrame *frame,
               PyObject **stack_pointer, _Py_CODEUNIT *next_instr
@@ -60,6 +117,8 @@ _justin_entry(PyThreadState *tstate, _PyInterpreterFrame *frame,
               , PyObject *_tos2
               , PyObject *_tos3
               , PyObject *_tos4
+              , double _ftos1
+              , double _ftos2
               )
 {
     __builtin_assume(_tos1 == stack_pointer[/* DON'T REPLACE ME */ -1]);
@@ -72,16 +131,62 @@ _justin_entry(PyThreadState *tstate, _PyInterpreterFrame *frame,
     uint8_t opcode = _JUSTIN_OPCODE;
     // XXX: This temporary solution only works because we don't trace KW_NAMES:
     PyObject *kwnames = NULL;
+    // Where GO_TO_TRACE is headed:
+    void *_justin_target;
+    // The instruction that's running (see INSTRUCTION_START):
+    _Py_CODEUNIT *_justin_prev_instr = next_instr;
 #ifdef Py_STATS
     int lastopcode = frame->prev_instr->op.code;
 #endif
+#ifndef _JUSTIN_INTERIOR
+    // Traces are entered wherever a BB starts, and some instructions leave
+    // next_instr somewhere else entirely (calls, for instance). Interior
+    // stencils only ever follow an instruction that does neither:
     if (next_instr != &_justin_next_instr) {
         goto _return_ok;
     }
-    if (opcode != JUMP_BACKWARD_QUICK && next_instr->op.code != opcode) {
+#else
+    __builtin_assume(next_instr == &_justin_next_instr);
+#endif
+#if !defined(_JUSTIN_FAMILY) && \
+    (!defined(_JUSTIN_INTERIOR) || defined(_JUSTIN_REWRITTEN_IN_PLACE))
+    // Tier 2 jumps rewrite themselves, but their machine code doesn't care
+    // (see below). Instructions that specialize in place are checked even
+    // inside a trace:
+    if (opcode != BB_BRANCH && opcode != BB_JUMP_BACKWARD_LAZY &&
+        next_instr->op.code != opcode)
+    {
         frame->prev_instr = next_instr;
         goto _return_deopt;
     }
+#endif
+#ifdef _JUSTIN_STATIC_STACK
+    // Tier 2 knows how deep the stack is here, so its top is a fixed offset
+    // from the frame. The stack_pointer passed in is only needed above, for
+    // bailing out when this isn't the instruction that's next after all (see
+    // --static-stack in Tools/justin/build.py):
+    stack_pointer = frame->localsplus + ((uintptr_t)&_justin_stack_level_plus_one - 1);
+#endif
+#if _JUSTIN_OPCODE == BB_BRANCH
+    // Each exit starts out as a stub that comes right back here, but with
+    // next_instr just before the branch. That bails to the tier 2 interpreter,
+    // which generates the BB the exit leads to and then patches the exit to
+    // jump straight there (see _PyTier2_EnterBB):
+    _JUSTIN_BB_BRANCH();
+#endif
+#if _JUSTIN_OPCODE == BB_JUMP_BACKWARD_LAZY
+    // The back edge of a loop. If the eval breaker is set, let the tier 2
+    // interpreter run the jump (and handle it). Otherwise, jump straight to the
+    // loop header's machine code. Like BB_BRANCH's, the exit starts out as a
+    // stub that bails to the interpreter just before the jump:
+    if (_Py_atomic_load_relaxed_int32(&tstate->interp->ceval.eval_breaker)) {
+        next_instr--;
+        goto _return_ok;
+    }
+    next_instr = &_justin_consequent_instr;
+    _justin_target = &_justin_consequent;
+    goto _jump;
+#endif
     // Now, the actual instruction definition:
 %s
     Py_UNREACHABLE();
@@ -94,6 +199,7 @@ _justin_entry(PyThreadState *tstate, _PyInterpreterFrame *frame,
     SET_LOCALS_FROM_FRAME();
     DISPATCH();
 handle_eval_breaker:
+    frame->prev_instr = _justin_prev_instr;
     if (_Py_HandlePending(tstate) != 0) {
         goto error;
     }
@@ -135,6 +241,7 @@ _justin_entry(PyThreadState *tstate, _PyInterpreterFrame *frame,
     _PyFrame_SetStackPointer(frame, stack_pointer);
     return _JUSTIN_RETURN_OK;
 _return_deopt:
+    frame->prev_instr = _justin_prev_instr;
     _PyFrame_SetStackPointer(frame, stack_pointer);
     return _JUSTIN_RETURN_DEOPT;
 _continue:
@@ -144,11 +251,34 @@ _justin_entry(PyThreadState *tstate, _PyInterpreterFrame *frame,
     _tos2 = stack_pointer[/* DON'T REPLACE ME */ -2];
     _tos3 = stack_pointer[/* DON'T REPLACE ME */ -3];
     _tos4 = stack_pointer[/* DON'T REPLACE ME */ -4];
+    _ftos1 = _justin_as_double(_tos1);
+    _ftos2 = _justin_as_double(_tos2);
     __attribute__((musttail))
     return _justin_continue(tstate, frame, stack_pointer, next_instr
                             , _tos1
                             , _tos2
                             , _tos3
                             , _tos4
+                            , _ftos1
+                            , _ftos2
                             );
+_jump:
+    ;  // XXX
+    // Straight into another BB's machine code:
+    _tos1 = stack_pointer[/* DON'T REPLACE ME */ -1];
+    _tos2 = stack_pointer[/* DON'T REPLACE ME */ -2];
+    _tos3 = stack_pointer[/* DON'T REPLACE ME */ -3];
+    _tos4 = stack_pointer[/* DON'T REPLACE ME */ -4];
+    _ftos1 = _justin_as_double(_tos1);
+    _ftos2 = _justin_as_double(_tos2);
+    __attribute__((musttail))
+    return ((__typeof__(&_justin_continue))_justin_target)(
+        tstate, frame, stack_pointer, next_instr
+        , _tos1
+        , _tos2
+        , _tos3
+        , _tos4
+        , _ftos1
+        , _ftos2
+        );
 }
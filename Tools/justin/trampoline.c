@@ -3,27 +3,39 @@
 #include "pycore_frame.h"
 #include "pycore_jit.h"
 
-// Stuff that will be patched at "JIT time":
-extern int _justin_continue(PyThreadState *tstate, _PyInterpreterFrame *frame,
-                            PyObject **stack_pointer, _Py_CODEUNIT *next_instr
-                            , PyObject *_tos1
-                            , PyObject *_tos2
-                            , PyObject *_tos3
-                            , PyObject *_tos4
-                            );
+// The machine code for each BB uses its own calling convention, so C code
+// always enters it through here (see GO_TO_TRACE in Python/ceval_macros.h):
+typedef _PyJITReturnCode (*_justin_entry)(PyThreadState *tstate,
+                                          _PyInterpreterFrame *frame,
+                                          PyObject **stack_pointer,
+                                          _Py_CODEUNIT *next_instr
+                                          , PyObject *_tos1
+                                          , PyObject *_tos2
+                                          , PyObject *_tos3
+                                          , PyObject *_tos4
+                                          , double _ftos1
+                                          , double _ftos2
+                                          );
 
 _PyJITReturnCode
 _justin_trampoline(PyThreadState *tstate, _PyInterpreterFrame *frame,
-                   PyObject **stack_pointer, _Py_CODEUNIT *next_instr)
+                   PyObject **stack_pointer, _Py_CODEUNIT *next_instr,
+                   void *entry)
 {
     PyObject *_tos1 = stack_pointer[/* DON'T REPLACE ME */ -1];
     PyObject *_tos2 = stack_pointer[/* DON'T REPLACE ME */ -2];
     PyObject *_tos3 = stack_pointer[/* DON'T REPLACE ME */ -3];
     PyObject *_tos4 = stack_pointer[/* DON'T REPLACE ME */ -4];
-    return _justin_continue(tstate, frame, stack_pointer, next_instr
+    // The same bits as _tos1 and _tos2, for unboxed floats (see template.c):
+    double _ftos1, _ftos2;
+    memcpy(&_ftos1, &_tos1, sizeof(_ftos1));
+    memcpy(&_ftos2, &_tos2, sizeof(_ftos2));
+    return ((_justin_entry)entry)(tstate, frame, stack_pointer, next_instr
                             , _tos1
                             , _tos2
                             , _tos3
                             , _tos4
+                            , _ftos1
+                            , _ftos2
                             );
 }
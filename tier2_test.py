@@ -658,6 +658,133 @@ def f(x, l):
 
     # As long as it doesn't crash, everything's good
 
+with TestInfo("machine code that keeps failing its guards"):
+    class A:
+        def __init__(self):
+            self.x = 1
+
+    class B:
+        def __init__(self):
+            self.y = 0
+            self.x = 2
+
+    def f(objs):
+        t = 0
+        for o in objs:
+            t = t + o.x
+        return t
+
+    a = [A() for _ in range(100)]
+    b = [B() for _ in range(100)]
+    trigger_tier2(f, (a,))
+    # The attribute loads deopt until the trace is compiled again
+    for _ in range(64):
+        assert f(b) == 200
+        assert f(a) == 100
+
+with TestInfo("loops compiled as one superblock"):
+    def f(n):
+        t = 0
+        for i in range(n):
+            if i % 3:
+                t = t + i
+            else:
+                t = t - 1
+        return t
+
+    expected = sum(i if i % 3 else -1 for i in range(1000))
+    trigger_tier2(f, (10,))
+    for _ in range(4):
+        assert f(1000) == expected
+
+with TestInfo("growing the BB space"):
+    # Every new type the loop sees gets its own versions of the loop's BBs,
+    # which end up in new chunks of the BB space, with far jumps between them.
+    def f(xs):
+        t = xs[0]
+        for x in xs:
+            t = t + x
+            t = t * x
+        return t
+
+    trigger_tier2(f, ([1, 2],))
+    co = f.__code__
+    for xs in ([1.5, 2.0], [1, 2], [1j, 2], [1.5, 2], [2, 0.5], [True, 3]):
+        expected = xs[0]
+        for x in xs:
+            expected = (expected + x) * x
+        for _ in range(70):
+            assert f(xs) == expected, (xs, f(xs), expected)
+    # More than fits in the first chunk (see OVERALLOCATE_FACTOR):
+    assert len(co._co_code_tier2) > max(2 * len(co._co_code_adaptive), 512)
+
+with TestInfo("dumping machine code"):
+    import os
+    import tempfile
+    import _testinternalcapi
+
+    def f(n):
+        t = 0.0
+        for i in range(n):
+            t = t + 1.5
+        return t
+
+    trigger_tier2(f, (10,))
+    for _ in range(4):
+        f(100)
+    with tempfile.TemporaryDirectory() as tmp:
+        path = os.path.join(tmp, "f.bin")
+        dumped = _testinternalcapi.jit_dump(f.__code__, path)
+        assert dumped > 0
+        with open(path + ".map") as map_file:
+            lines = map_file.readlines()
+        bbs = [line for line in lines if line.startswith("BB ")]
+        assert len(bbs) == dumped
+        # "BB 1 (...): entry 0x..., 123 bytes at file offset 0x..."
+        size = sum(int(line.split(", ")[1].split()[0]) for line in bbs)
+        assert size == os.path.getsize(path)
+        assert any("BB_JUMP_BACKWARD_LAZY" in line for line in lines)
+
+with TestInfo("capping loop versions"):
+    import _testinternalcapi
+
+    # Past the cap, every new type goes to the loop's generic version, boxing
+    # its floats first.
+    def f(xs):
+        t = xs[0]
+        for x in xs:
+            t = t + x
+            t = t * x
+        return t
+
+    old_cap = _testinternalcapi.get_tier2_max_bb_versions()
+    _testinternalcapi.set_tier2_max_bb_versions(1)
+    try:
+        trigger_tier2(f, ([1, 2],))
+    finally:
+        _testinternalcapi.set_tier2_max_bb_versions(old_cap)
+    co = f.__code__
+
+    def check_all():
+        for xs in ([1.5, 2.0], [1j, 2], [1.5, 2], [2, 0.5], [True, 3], [1, 2]):
+            expected = xs[0]
+            for x in xs:
+                expected = (expected + x) * x
+            for _ in range(70):
+                assert f(xs) == expected, (xs, f(xs), expected)
+
+    check_all()
+    size = len(co._co_code_tier2)
+    # Nothing new the second time around:
+    check_all()
+    assert len(co._co_code_tier2) == size
+    try:
+        _testinternalcapi.set_tier2_max_bb_versions(0)
+    except ValueError:
+        pass
+    else:
+        assert False
+
 print("Regression tests...Done!")
 
 print("Tests completed ^-^")
\ No newline at end of file